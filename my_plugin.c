@@ -23,6 +23,10 @@
 
 #include <string.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <math.h>
+#include <stddef.h>
 
 #include "hal.h"
 #include "motion_control.h"
@@ -30,6 +34,10 @@
 #include "grbl/nvs_buffer.h"
 #include "grbl/nuts_bolts.h"
 
+#if SDCARD_ENABLE
+#include "grbl/vfs.h"
+#endif
+
 #include "my_plugin.h"
 typedef enum {
     Motor_Off = 0,
@@ -37,6 +45,94 @@ typedef enum {
     Motor_CCW = 2
 } atc_motor_state_t;
 
+#define ATC_MAX_RACKS 4
+
+// Settings of the racks after the first, the first rack is set up by the magazine settings.
+// A rack is a row of pockets or a grid of rows, pockets are numbered along each row first.
+typedef struct {
+    uint8_t  pockets;               // 0 if the rack is not fitted
+    uint8_t  rows;
+    uint8_t  alignment;
+    uint8_t  direction;
+    float    pocket_offset;
+    float    row_offset;            // distance from one row to the next, signed
+    float    pocket_1_x_pos;
+    float    pocket_1_y_pos;
+    float    z_offset;              // added to the Z heights of the magazine settings
+} atc_rack_settings_t;
+
+#define ATC_MAX_KEEPOUTS 4
+
+// Obstacle the spindle must not enter, extending down from its top. Set when X Max > X Min and Y Max > Y Min.
+typedef struct {
+    float    x_min;
+    float    x_max;
+    float    y_min;
+    float    y_max;
+    float    z_top;
+} atc_keepout_settings_t;
+
+typedef struct {
+    char     alignment;
+    char     direction;
+    uint8_t  number_of_pockets;
+    uint16_t pocket_offset;
+    float    pocket_1_x_pos;
+    float    pocket_1_y_pos;
+    char     origin;
+    uint16_t tool_engagement_feed_rate;
+    uint16_t tool_pickup_rpm;
+    uint16_t tool_dropoff_rpm;
+    float    tool_z_engagement;
+    float    tool_z_traverse;
+    float    tool_z_safe_clearance;
+    float    tool_z_retract;
+    float    tool_start_height;
+    bool     tool_setter;
+    bool     tool_recognition;
+    bool     dust_cover;
+    uint16_t toolsetter_offset;
+    uint16_t toolsetter_seek_rate;
+    uint16_t toolsetter_retreat;
+    uint16_t toolsetter_feed_rate;
+    uint16_t toolsetter_max_travel;
+    float    toolsetter_x_pos;
+    float    toolsetter_y_pos;
+    float    toolsetter_z_start_pos;
+    float    toolsetter_safe_z;
+    float    toolsetter_margin;
+    float    thread_pitch;
+    uint8_t  thread_overfeed;
+    uint16_t spinup_delay;
+    uint16_t spindown_delay;
+    uint16_t dust_cover_delay;
+    uint8_t  toolrecognition_input;
+    float    toolrecognition_detect_zone_1;
+    float    toolrecognition_detect_zone_2;
+    uint8_t  dust_cover_axis;
+    uint8_t  dust_cover_open_position;
+    uint8_t  dust_cover_closed_position;
+    uint8_t  dust_cover_output;
+    uint8_t  port;
+    bool     swap_mode;
+    uint8_t  dropoff_policy;
+    uint8_t  trace_level;
+    bool     trace_when_idle;
+    bool     persist_stats;
+    bool     tlo_cache;
+    uint16_t tlo_cache_expiry;
+    uint8_t  rows;
+    float    row_offset;
+    atc_rack_settings_t rack[ATC_MAX_RACKS - 1];
+    float    keepout_margin;
+    atc_keepout_settings_t keepout[ATC_MAX_KEEPOUTS];
+    bool     lookahead;
+    float    manual_x_pos;
+    float    manual_y_pos;
+} plugin_settings_t;
+
+// Layout of the settings written by releases before the versioned image, as a raw copy of the settings
+// struct with the grblHAL checksum.
 typedef struct {
     char     alignment;
     char     direction;
@@ -73,27 +169,459 @@ typedef struct {
     uint8_t  dust_cover_closed_position;
     uint8_t  dust_cover_output;
     uint8_t  port;
-} plugin_settings_t;
+} plugin_settings_legacy_t;
+
+// Stored settings image: magic, version, payload length, packed fields and a CRC-16 over version to payload.
+#define ATC_SETTINGS_MAGIC      0xA7
+#define ATC_SETTINGS_VERSION    2
+#define ATC_SETTINGS_HEADER     4
+#define ATC_SETTINGS_IMAGE      (ATC_SETTINGS_HEADER + sizeof(plugin_settings_t) + 2)
+#define ATC_SETTINGS_NVS        384     // Reserved for the image so appended fields do not move the data allocated after it
+
+_Static_assert(ATC_SETTINGS_IMAGE <= ATC_SETTINGS_NVS, "ATC settings image does not fit the NVS space reserved for it");
+
+// Versions of the optional stored blocks, written in a byte ahead of each. A block stored with
+// another version is discarded when loaded, bump it when the layout of the block changes.
+#define ATC_CHECKPOINT_VERSION  1
+#define ATC_OCCUPANCY_VERSION   1
+#define ATC_TLO_VERSION         1
+#define ATC_STATS_VERSION       1
+#define ATC_MAP_VERSION         1
+
+typedef struct {
+    uint16_t offset;
+    uint8_t  size;
+} atc_settings_field_t;
+
+#define ATC_FIELD(field) { offsetof(plugin_settings_t, field), sizeof(((plugin_settings_t *)0)->field) }
+
+#ifndef ATC_MAX_POCKETS
+#define ATC_MAX_POCKETS     240     // Over all racks
+#endif
+#ifndef ATC_NVS_POCKETS
+#define ATC_NVS_POCKETS     64      // Pockets with their tool kept in NVS, 4 bytes each. Tool N is in pocket N above them after a restart.
+#endif
+#define ATC_MAP_NVS         (ATC_NVS_POCKETS * sizeof(uint32_t))
+#define ATC_NO_POCKET       0xFFFF
+
+// Size of the tool to pocket index, at least twice ATC_MAX_POCKETS so that probing always finds a free slot.
+#if ATC_MAX_POCKETS <= 128
+#define ATC_TOOL_HASH_BITS  8
+#elif ATC_MAX_POCKETS <= 256
+#define ATC_TOOL_HASH_BITS  9
+#elif ATC_MAX_POCKETS <= 512
+#define ATC_TOOL_HASH_BITS  10
+#elif ATC_MAX_POCKETS <= 1024
+#define ATC_TOOL_HASH_BITS  11
+#else
+#define ATC_TOOL_HASH_BITS  12
+#endif
+#define ATC_TOOL_HASH_SIZE  (1 << ATC_TOOL_HASH_BITS)
+
+_Static_assert(ATC_TOOL_HASH_SIZE >= 2 * ATC_MAX_POCKETS, "ATC tool index must have at least twice as many slots as pockets");
+_Static_assert(ATC_NVS_POCKETS <= ATC_MAX_POCKETS, "ATC pockets kept in NVS must not exceed ATC_MAX_POCKETS");
+
+typedef enum {
+    DropOff_ToolPocket = 0,         // Return the tool to the pocket assigned to it
+    DropOff_NearestFree             // Drop the tool in the free pocket nearest the pocket of the next tool
+} atc_dropoff_policy_t;
+
+// Tool assigned to each pocket, 0 if none. The pocket of the tool in the spindle is physically empty.
+typedef struct {
+    uint32_t tool_id[ATC_MAX_POCKETS];
+} atc_pocket_map_t;
+
+typedef struct {
+    uint16_t first;                         // index of the first pocket of the rack
+    uint16_t pockets;
+    uint16_t columns;                       // pockets in each row
+    uint8_t  axis;                          // alignment axis
+    float    direction;                     // 1.0 or -1.0 along the alignment axis
+    float    pocket_offset;
+    float    row_offset;
+    float    z_offset;
+} atc_rack_t;
+
+// Keep-out box expanded by the margin, open at the bottom.
+typedef struct {
+    float    min[2];
+    float    max[2];
+    float    top;
+} atc_box_t;
+
+// Pocket positions and validation result compiled from the settings when they are loaded or saved.
+typedef struct {
+    status_code_t status;                   // Status_OK if the geometry is valid
+    const char    *error;                   // reason if not
+    uint16_t      n_pockets;                // over all racks
+    uint8_t       n_racks;
+    uint8_t       n_keepouts;               // configured keep-out boxes, the path planner is used if any
+    uint8_t       n_boxes;                  // keep-out boxes followed by a box over each rack
+    float         z_traverse;               // lowest traverse height over the racks
+    atc_rack_t    rack[ATC_MAX_RACKS];
+    atc_box_t     box[ATC_MAX_KEEPOUTS + ATC_MAX_RACKS];
+    uint8_t       rack_of[ATC_MAX_POCKETS]; // rack of each pocket
+    float         x[ATC_MAX_POCKETS];
+    float         y[ATC_MAX_POCKETS];
+} atc_geometry_t;
+
+typedef enum {
+    ATC_Idle = 0,
+    ATC_CoolantOff,
+    ATC_UnloadApproach,
+    ATC_Unthread,
+    ATC_LoadApproach,
+    ATC_Thread,
+    ATC_Recognition,
+    ATC_Measure,
+    ATC_Return,
+    ATC_Manual,
+    ATC_NumPhases
+} atc_phase_t;
+
+static const char *const phase_name[] = {
+    "Idle",
+    "CoolantOff",
+    "UnloadApproach",
+    "Unthread",
+    "LoadApproach",
+    "Thread",
+    "Recognition",
+    "Measure",
+    "Return",
+    "Manual"
+};
+
+typedef enum {
+    Trace_Off = 0,
+    Trace_Phases,
+    Trace_All
+} atc_trace_level_t;
+
+#define ATC_TRACE_SIZE 64   // Must be a power of 2
+
+typedef struct {
+    uint32_t        ms;
+    const char      *message;
+    uint8_t         phase;
+    struct {
+        uint8_t     target :1,
+                    plan   :1;
+    } flags;
+    spindle_state_t spindle;
+    float           target[3];
+    float           feed;           // 0 for rapids
+    float           rpm;
+} atc_trace_event_t;
+
+// Single producer, single consumer ring buffer of trace events.
+typedef struct {
+    volatile uint16_t head;         // written by trace_event() only
+    volatile uint16_t tail;         // written by trace_drain() only
+    uint16_t          dropped;
+    atc_trace_event_t event[ATC_TRACE_SIZE];
+} atc_trace_t;
+
+#define ATC_STATS_BUCKETS 8
+#define ATC_STATS_CYCLE   ATC_NumPhases     // Index of the statistics for the complete tool change
+
+static const uint16_t stats_bucket_ms[ATC_STATS_BUCKETS - 1] = { 100, 250, 500, 1000, 2000, 5000, 10000 };
+
+typedef struct {
+    uint32_t count;
+    float    min;                           // ms
+    float    max;                           // ms
+    float    sum;                           // ms
+    uint16_t histogram[ATC_STATS_BUCKETS];  // last bucket counts durations of 10 s and more
+} atc_phase_stats_t;
+
+typedef struct {
+    atc_phase_stats_t phase[ATC_NumPhases + 1];
+} atc_stats_t;
+
+#define ATC_TIMING_RUNS 8
+
+// Consecutive planned moves of the same phase.
+typedef struct {
+    atc_phase_t phase;
+    uint16_t    moves;
+} atc_timing_run_t;
+
+// Tracks the phase being executed by the machine, as opposed to the phase being planned.
+// The planner blocks keep the line number of the program, the phases of the moves are kept here.
+typedef struct {
+    bool             active;
+    atc_phase_t      phase;
+    uint32_t         phase_start;           // us
+    uint32_t         cycle_start;           // us
+    plan_block_t     *block;                // block executing at the last update
+    uint_fast8_t     runs;
+    atc_timing_run_t run[ATC_TIMING_RUNS];  // phases of the moves not completed, oldest first
+} atc_timing_t;
+
+#define ATC_TLO_CACHE_SIZE 16
+
+// Tool length measured on the tool setter.
+typedef struct {
+    uint32_t tool_id;
+    int32_t  contact;                       // Z contact position in steps, machine coordinates
+    uint32_t stamp;                         // value of the tool change counter when measured
+    bool     valid;
+} atc_tlo_entry_t;
+
+typedef struct {
+    atc_tlo_entry_t entry[ATC_TLO_CACHE_SIZE];
+} atc_tlo_cache_t;
+
+#define ATC_SPINUP_TIMEOUT 10000    // ms, for spindles reporting at speed
+
+#define ATC_LATCH_SIZE 8
+#define ATC_NO_PORT    0xFF
+
+typedef struct {
+    int32_t position;                       // steps
+    bool    blocked;
+} atc_edge_t;
+
+// Recognition sensor edges latched by the input interrupt, while Z rises through the detect zones
+// or while the spindle passes along the magazine during a scan.
+typedef struct {
+    uint8_t           port;                 // claimed input port, ATC_NO_PORT if none
+    bool              irq;                  // edges are latched by interrupt, else the sensor is read when stopped
+    volatile bool     armed;
+    bool              initial;              // sensor state when armed, true if blocked
+    uint8_t           axis;                 // axis position latched
+    int32_t           z_armed;              // steps
+    int32_t           z_last;               // Z at the previous check while waiting for the sweep to start, steps
+    volatile uint16_t count;
+    uint16_t          size;
+    atc_edge_t        *edge;
+} atc_latch_t;
+
+// Pockets found holding a clamping nut by the last magazine scan, kept up to date by tool changes.
+typedef struct {
+    bool    valid;
+    uint8_t occupied[(ATC_MAX_POCKETS + 7) / 8];
+} atc_occupancy_t;
+
+// Tool change state written at phase boundaries once the motion planned before the boundary is completed.
+typedef struct {
+    uint8_t  phase;                 // phase entered, ATC_Idle if no tool change was interrupted
+    bool     load;
+    uint16_t drop_pocket;
+    uint16_t pick_pocket;
+    uint32_t unload_tool;
+    uint32_t load_tool;
+    uint32_t spindle_tool;          // tool in the spindle when the phase was entered
+    float    z_travel;
+    uint32_t changes;               // tool change counter, kept with the checkpoint as it is written on every change
+} atc_checkpoint_t;
+
+typedef enum {
+    Phase_Continue = 0,
+    Phase_Wait,
+    Phase_Done,
+    Phase_Error
+} phase_result_t;
+
+#define ATC_SCAN_MAX_TOOLS 24
+
+// Pocket assignment proposed by a job scan.
+typedef struct {
+    bool     valid;
+    uint8_t  n_tools;
+    uint32_t changes;
+    uint32_t manual_changes;        // changes involving tools without a pocket in the current layout
+    float    current_distance;
+    float    planned_distance;
+    uint32_t tool_id[ATC_SCAN_MAX_TOOLS];
+    uint16_t pocket[ATC_SCAN_MAX_TOOLS];
+} atc_job_plan_t;
+
+#define ATC_PATH_SIZE 4
+
+// Tool change sequence state, advanced from the realtime loop.
+typedef struct {
+    atc_phase_t      phase;
+    uint8_t          step;              // step within the current phase
+    uint8_t          retries;
+    bool             load;              // threading the next tool rather than unthreading the current one
+    uint16_t         drop_pocket;       // pocket to drop the current tool in, ATC_NO_POCKET for a manual unload
+    uint16_t         pick_pocket;       // pocket to pick the next tool from, ATC_NO_POCKET for a manual load
+    uint32_t         unload_tool;
+    uint32_t         load_tool;
+    char             recognition;       // result of the last recognition check, - if none, Y if passed, N if failed
+    volatile bool    busy;
+    bool             queued;            // moves were planned by the current pass of the sequence, cycle start is pending
+    float            z_travel;          // Z height used when moving from the drop-off to the pickup pocket
+    float            z_offset;          // Z offset of the rack of the pocket approached
+    bool             blend;             // blend the climb out of the work into the first move, planned by lookahead
+    bool             manual_load;       // the next tool was put in by hand
+    uint8_t          path_length;       // waypoints of the path being planned, 0 if none
+    uint8_t          path_next;
+    coord_data_t     path[ATC_PATH_SIZE];
+    status_code_t    status;
+    coord_data_t     target;            // end position of the last planned move
+    plan_line_data_t plan_data;
+} atc_sequence_t;
+
+// Pockets of the next tool change, planned when the next tool is selected ahead of M6.
+typedef struct {
+    bool     valid;
+    uint32_t tool_id;                   // tool to load
+    uint32_t spindle_tool;              // tool in the spindle when planned
+    uint16_t drop_pocket;
+    uint16_t pick_pocket;
+    float    z_travel;
+} atc_lookahead_t;
 
 static volatile bool execute_posted = false;
 static volatile uint32_t spin_lock = 0;
-static nvs_address_t nvs_address;
+static nvs_address_t nvs_address, map_address, stats_address, tlo_address, occupancy_address, checkpoint_address;
+static struct {
+    const char *name;
+    bool        discarded;              // failed the checksum or written with another version, else no NVS storage
+} nvs_lost[6];                          // stored data not kept, reported once the controller is up
+static uint_fast8_t n_lost = 0;
 static uint8_t port, n_ports;
 static char max_port[4];
 static plugin_settings_t my_settings;
+static uint8_t settings_image[ATC_SETTINGS_NVS];     // copy of the settings image in NVS, only changed bytes are written
+
+// Order of the fields in the settings image, new fields must be appended.
+static const atc_settings_field_t settings_fields[] = {
+    ATC_FIELD(alignment),
+    ATC_FIELD(direction),
+    ATC_FIELD(number_of_pockets),
+    ATC_FIELD(pocket_offset),
+    ATC_FIELD(pocket_1_x_pos),
+    ATC_FIELD(pocket_1_y_pos),
+    ATC_FIELD(origin),
+    ATC_FIELD(tool_engagement_feed_rate),
+    ATC_FIELD(tool_pickup_rpm),
+    ATC_FIELD(tool_dropoff_rpm),
+    ATC_FIELD(tool_z_engagement),
+    ATC_FIELD(tool_z_traverse),
+    ATC_FIELD(tool_z_safe_clearance),
+    ATC_FIELD(tool_z_retract),
+    ATC_FIELD(tool_start_height),
+    ATC_FIELD(tool_setter),
+    ATC_FIELD(tool_recognition),
+    ATC_FIELD(dust_cover),
+    ATC_FIELD(toolsetter_offset),
+    ATC_FIELD(toolsetter_seek_rate),
+    ATC_FIELD(toolsetter_retreat),
+    ATC_FIELD(toolsetter_feed_rate),
+    ATC_FIELD(toolsetter_max_travel),
+    ATC_FIELD(toolsetter_x_pos),
+    ATC_FIELD(toolsetter_y_pos),
+    ATC_FIELD(toolsetter_z_start_pos),
+    ATC_FIELD(toolsetter_safe_z),
+    ATC_FIELD(toolrecognition_input),
+    ATC_FIELD(toolrecognition_detect_zone_1),
+    ATC_FIELD(toolrecognition_detect_zone_2),
+    ATC_FIELD(dust_cover_axis),
+    ATC_FIELD(dust_cover_open_position),
+    ATC_FIELD(dust_cover_closed_position),
+    ATC_FIELD(dust_cover_output),
+    ATC_FIELD(port),
+    ATC_FIELD(swap_mode),
+    ATC_FIELD(dropoff_policy),
+    ATC_FIELD(trace_level),
+    ATC_FIELD(trace_when_idle),
+    ATC_FIELD(persist_stats),
+    ATC_FIELD(tlo_cache),
+    ATC_FIELD(tlo_cache_expiry),
+    ATC_FIELD(toolsetter_margin),
+    ATC_FIELD(thread_pitch),
+    ATC_FIELD(thread_overfeed),
+    ATC_FIELD(spinup_delay),
+    ATC_FIELD(spindown_delay),
+    ATC_FIELD(dust_cover_delay),
+    ATC_FIELD(rows),
+    ATC_FIELD(row_offset),
+    ATC_FIELD(rack),
+    ATC_FIELD(keepout_margin),
+    ATC_FIELD(keepout),
+    ATC_FIELD(lookahead),
+    ATC_FIELD(manual_x_pos),
+    ATC_FIELD(manual_y_pos)
+};
 static tool_data_t current_tool, *next_tool = NULL;
 static driver_reset_ptr driver_reset = NULL;
 static on_report_options_ptr on_report_options;
+static on_execute_realtime_ptr on_execute_realtime;
+static on_realtime_report_ptr on_realtime_report;
+static on_program_completed_ptr on_program_completed;
+static atc_sequence_t sequence = {0};
+static atc_lookahead_t lookahead = {0};
+static atc_pocket_map_t pocket_map;
+static atc_geometry_t geometry = { .status = Status_OK };
+static uint16_t tool_index[ATC_TOOL_HASH_SIZE];    // pocket + 1 of the tools in the map, 0 for an empty slot
+static atc_job_plan_t job_plan = {0};
+static atc_trace_t trace = {0};
+static atc_stats_t stats = {0};
+static atc_timing_t timing = {0};
+static atc_tlo_cache_t tlo_cache = {0};
+static atc_edge_t recognition_edge[ATC_LATCH_SIZE];
+static atc_latch_t latch = { .port = ATC_NO_PORT, .axis = Z_AXIS, .size = ATC_LATCH_SIZE, .edge = recognition_edge };
+static atc_occupancy_t occupancy = {0};
+static atc_checkpoint_t checkpoint = {0}, checkpoint_next = {0};   // last written and pending checkpoint
+static bool checkpoint_pending = false;
+static uint32_t tool_changes = 0;  // tool change counter, the timestamp of the tool length cache entries
+static tool_data_t resume_tool = {0};
+static uint32_t spindle_on_ms = 0, spindle_off_ms = 0, cover_ms = 0;
+static uint8_t cover_port = ATC_NO_PORT;
+static bool cover_open = false;
+static char status_field[64] = "";     // Preformatted real-time report element, empty when no tool change is in progress
 //static coord_data_t offset;
 
 static const setting_group_detail_t user_groups [] = {
     { Group_Root, Group_UserSettings, "RapidChange ATC"}
 };
 
+// Settings of racks 2 to ATC_MAX_RACKS, with ids from base to base + 8.
+#define ATC_RACK_SETTINGS(n, base) \
+    { base, Group_UserSettings, "Rack " #n " Pockets", NULL, Format_Int8, "##0", "0", "240", Setting_IsExtended, &my_settings.rack[n - 2].pockets, NULL, NULL }, \
+    { base + 1, Group_UserSettings, "Rack " #n " Rows", NULL, Format_Int8, "#0", "0", "24", Setting_IsExtended, &my_settings.rack[n - 2].rows, NULL, NULL }, \
+    { base + 2, Group_UserSettings, "Rack " #n " Alignment", "Axis", Format_RadioButtons, "X,Y", NULL, NULL, Setting_IsExtended, &my_settings.rack[n - 2].alignment, NULL, NULL }, \
+    { base + 3, Group_UserSettings, "Rack " #n " Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_IsExtended, &my_settings.rack[n - 2].direction, NULL, NULL }, \
+    { base + 4, Group_UserSettings, "Rack " #n " Pocket Offset", "mm", Format_Decimal, "###0.000", "0", "3000", Setting_IsExtended, &my_settings.rack[n - 2].pocket_offset, NULL, NULL }, \
+    { base + 5, Group_UserSettings, "Rack " #n " Row Offset", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.rack[n - 2].row_offset, NULL, NULL }, \
+    { base + 6, Group_UserSettings, "Rack " #n " Pocket 1 X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.rack[n - 2].pocket_1_x_pos, NULL, NULL }, \
+    { base + 7, Group_UserSettings, "Rack " #n " Pocket 1 Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.rack[n - 2].pocket_1_y_pos, NULL, NULL }, \
+    { base + 8, Group_UserSettings, "Rack " #n " Z Offset", "mm", Format_Decimal, "-##0.000", "-120", "120", Setting_IsExtended, &my_settings.rack[n - 2].z_offset, NULL, NULL }
+
+#define ATC_RACK_DESCRIPTIONS(n, base) \
+    { base, "Value: Count\\n\\nThe number of pockets in rack " #n ", 0 if the rack is not fitted. Pockets are numbered after those of the previous racks." }, \
+    { base + 1, "Value: Count\\n\\nThe number of rows the pockets of rack " #n " are arranged in, pockets are numbered along each row first. 0 or 1 for a single row." }, \
+    { base + 2, "Value: X Axis or Y Axis\\n\\nThe axis along which the rows of rack " #n " are aligned in the XY plane." }, \
+    { base + 3, "Value: Positive or Negative\\n\\nThe direction of travel along the alignment axis from one pocket of rack " #n " to the next." }, \
+    { base + 4, "Value: Distance (mm)\\n\\nThe distance from one pocket of rack " #n " to the next in a row when measuring from center to center." }, \
+    { base + 5, "Value: Distance (mm)\\n\\nThe distance from one row of rack " #n " to the next across the alignment axis, negative when the rows are in the negative direction." }, \
+    { base + 6, "Value: X Machine Coordinate (mm)\\n\\nThe x axis position referencing the center of the first pocket of rack " #n "." }, \
+    { base + 7, "Value: Y Machine Coordinate (mm)\\n\\nThe y axis position referencing the center of the first pocket of rack " #n "." }, \
+    { base + 8, "Value: Distance (mm)\\n\\nThe height of rack " #n " relative to the first rack, added to the Z heights used at its pockets and to the detect zones." }
+
+// Settings of a keep-out box, with ids from base to base + 4.
+#define ATC_KEEPOUT_SETTINGS(n, base) \
+    { base, Group_UserSettings, "Keep-out " #n " X Min", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.keepout[n - 1].x_min, NULL, NULL }, \
+    { base + 1, Group_UserSettings, "Keep-out " #n " X Max", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.keepout[n - 1].x_max, NULL, NULL }, \
+    { base + 2, Group_UserSettings, "Keep-out " #n " Y Min", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.keepout[n - 1].y_min, NULL, NULL }, \
+    { base + 3, Group_UserSettings, "Keep-out " #n " Y Max", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.keepout[n - 1].y_max, NULL, NULL }, \
+    { base + 4, Group_UserSettings, "Keep-out " #n " Z Top", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.keepout[n - 1].z_top, NULL, NULL }
+
+#define ATC_KEEPOUT_DESCRIPTIONS(n, base) \
+    { base, "Value: X Machine Coordinate (mm)\\n\\nThe lowest X position of keep-out box " #n ". The box is used when X Max is above X Min and Y Max is above Y Min." }, \
+    { base + 1, "Value: X Machine Coordinate (mm)\\n\\nThe highest X position of keep-out box " #n "." }, \
+    { base + 2, "Value: Y Machine Coordinate (mm)\\n\\nThe lowest Y position of keep-out box " #n "." }, \
+    { base + 3, "Value: Y Machine Coordinate (mm)\\n\\nThe highest Y position of keep-out box " #n "." }, \
+    { base + 4, "Value: Z Machine Coordinate (mm)\\n\\nThe top of keep-out box " #n ", the box extends down from here. Must be below Safe Clearance." }
+
 static const setting_detail_t user_settings[] = {
     { 900, Group_UserSettings, "Alignment", "Axis", Format_RadioButtons, "X,Y", NULL, NULL, Setting_IsExtended, &my_settings.alignment, NULL, NULL },
     { 901, Group_UserSettings, "Direction", NULL, Format_RadioButtons, "Positive,Negative", NULL, NULL, Setting_IsExtended, &my_settings.direction, NULL, NULL },
-    { 902, Group_UserSettings, "Number of tool pockets", NULL, Format_Int8, "#00", "0", "120", Setting_IsExtended, &my_settings.number_of_pockets, NULL, NULL },
+    { 902, Group_UserSettings, "Number of tool pockets", NULL, Format_Int8, "##0", "0", "240", Setting_IsExtended, &my_settings.number_of_pockets, NULL, NULL },
     { 903, Group_UserSettings, "Pocket Offset", "mm", Format_Int16, "###0", "0", "3000", Setting_IsExtended, &my_settings.pocket_offset, NULL, NULL },
     { 904, Group_UserSettings, "Pocket 1 X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.pocket_1_x_pos, NULL, NULL },
     { 905, Group_UserSettings, "Pocket 1 Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.pocket_1_y_pos, NULL, NULL },
@@ -106,25 +634,51 @@ static const setting_detail_t user_settings[] = {
     { 912, Group_UserSettings, "Tool Z Traverse", "mm", Format_Decimal, "-##0.000", "-120", "120", Setting_IsExtended, &my_settings.tool_z_traverse, NULL, NULL },
     { 913, Group_UserSettings, "Tool Z Safe Clearance", "mm", Format_Decimal, "-##0.000", "-120", "120", Setting_IsExtended, &my_settings.tool_z_safe_clearance, NULL, NULL },
     { 914, Group_UserSettings, "Tool Setter", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.tool_setter, NULL, NULL },
-    { 915, Group_UserSettings, "Tool Recognition", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.tool_recognition, NULL, NULL },
-    { 916, Group_UserSettings, "Dust Cover", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.dust_cover, NULL, NULL },
-    { 917, Group_UserSettings, "Setter Tool Offset", NULL, Format_Int8, "##0", "0", "255", Setting_IsExtended, &my_settings.toolsetter_offset, NULL, NULL },
-    { 918, Group_UserSettings, "Setter Seek Rate", NULL, Format_Int8, "###0", "0", "5000", Setting_IsExtended, &my_settings.toolsetter_seek_rate, NULL, NULL },
-    { 919, Group_UserSettings, "Setter Retreat", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.toolsetter_retreat, NULL, NULL },
+    { 915, Group_UserSettings, "Tool Recognition", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.tool_recognition, NULL, NULL, { .reboot_required = On } },
+    { 916, Group_UserSettings, "Dust Cover", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.dust_cover, NULL, NULL, { .reboot_required = On } },
+    { 917, Group_UserSettings, "Setter Tool Offset", NULL, Format_Int16, "##0", "0", "255", Setting_IsExtended, &my_settings.toolsetter_offset, NULL, NULL },
+    { 918, Group_UserSettings, "Setter Seek Rate", NULL, Format_Int16, "###0", "0", "5000", Setting_IsExtended, &my_settings.toolsetter_seek_rate, NULL, NULL },
+    { 919, Group_UserSettings, "Setter Retreat", NULL, Format_Int16, "##0", "0", "250", Setting_IsExtended, &my_settings.toolsetter_retreat, NULL, NULL },
     { 920, Group_UserSettings, "Setter Feed Rate", NULL, Format_Int16, "###0", "0", "5000", Setting_IsExtended, &my_settings.toolsetter_feed_rate, NULL, NULL },
-    { 921, Group_UserSettings, "Setter Max Travel", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.toolsetter_max_travel, NULL, NULL },
+    { 921, Group_UserSettings, "Setter Max Travel", NULL, Format_Int16, "##0", "0", "250", Setting_IsExtended, &my_settings.toolsetter_max_travel, NULL, NULL },
     { 922, Group_UserSettings, "Setter X Pos", NULL, Format_Decimal, "####0.000", NULL, NULL, Setting_IsExtended, &my_settings.toolsetter_x_pos, NULL, NULL },
     { 923, Group_UserSettings, "Setter Y Pos", NULL, Format_Decimal, "####0.000", NULL, NULL, Setting_IsExtended, &my_settings.toolsetter_y_pos, NULL, NULL },
     { 924, Group_UserSettings, "Setter Z Start Pos", NULL, Format_Decimal, "####0.000", NULL, NULL, Setting_IsExtended, &my_settings.toolsetter_z_start_pos, NULL, NULL },
     { 925, Group_UserSettings, "Setter Safe Z", NULL, Format_Decimal, "####0.000", NULL, NULL, Setting_IsExtended, &my_settings.toolsetter_safe_z, NULL, NULL },
-    { 926, Group_UserSettings, "Tool Recognition Input", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.toolrecognition_input, NULL, NULL },
+    { 926, Group_UserSettings, "Tool Recognition Input", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.toolrecognition_input, NULL, NULL, { .reboot_required = On } },
     { 927, Group_UserSettings, "Tool Recognition Detect Zone 1", NULL, Format_Decimal, "####0.000", NULL, NULL, Setting_IsExtended, &my_settings.toolrecognition_detect_zone_1, NULL, NULL },
     { 928, Group_UserSettings, "Tool Recognition Detect Zone 2", NULL, Format_Decimal, "####0.000", NULL, NULL, Setting_IsExtended, &my_settings.toolrecognition_detect_zone_2, NULL, NULL },
-    { 929, Group_UserSettings, "Dust Cover Axis", NULL, Format_RadioButtons, "Use Output Pin,A-Axis,B-Axis,C-Axis", NULL, NULL, Setting_IsExtended, &my_settings.dust_cover_axis, NULL, NULL },
+    { 929, Group_UserSettings, "Dust Cover Axis", NULL, Format_RadioButtons, "Use Output Pin,A-Axis,B-Axis,C-Axis", NULL, NULL, Setting_IsExtended, &my_settings.dust_cover_axis, NULL, NULL, { .reboot_required = On } },
     { 930, Group_UserSettings, "Dust Cover Open Position", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.dust_cover_open_position, NULL, NULL },
     { 931, Group_UserSettings, "Dust Cover Closed Position", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.dust_cover_closed_position, NULL, NULL },
-    { 932, Group_UserSettings, "Dust Cover Output", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.dust_cover_output, NULL, NULL },
+    { 932, Group_UserSettings, "Dust Cover Output", NULL, Format_Int8, "##0", "0", "250", Setting_IsExtended, &my_settings.dust_cover_output, NULL, NULL, { .reboot_required = On } },
     { 933, Group_UserSettings, "Embroidery trigger port", NULL, Format_Int8, "#0", "0", max_port, Setting_NonCore, &my_settings.port, NULL, is_setting_available, { .reboot_required = On } },
+    { 934, Group_UserSettings, "Swap Mode", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.swap_mode, NULL, NULL },
+    { 935, Group_UserSettings, "Drop-off Policy", NULL, Format_RadioButtons, "Tool pocket, Nearest free", NULL, NULL, Setting_IsExtended, &my_settings.dropoff_policy, NULL, NULL },
+    { 936, Group_UserSettings, "Trace Level", NULL, Format_RadioButtons, "Off, Phases, All", NULL, NULL, Setting_IsExtended, &my_settings.trace_level, NULL, NULL },
+    { 937, Group_UserSettings, "Trace Output", NULL, Format_RadioButtons, "On request, When idle", NULL, NULL, Setting_IsExtended, &my_settings.trace_when_idle, NULL, NULL },
+    { 938, Group_UserSettings, "Persist Statistics", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.persist_stats, NULL, NULL },
+    { 939, Group_UserSettings, "Tool Length Cache", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.tlo_cache, NULL, NULL },
+    { 940, Group_UserSettings, "Tool Length Cache Expiry", "changes", Format_Int16, "####0", "0", "65535", Setting_IsExtended, &my_settings.tlo_cache_expiry, NULL, NULL },
+    { 941, Group_UserSettings, "Setter Predictive Margin", "mm", Format_Decimal, "##0.000", "0", "100", Setting_IsExtended, &my_settings.toolsetter_margin, NULL, NULL },
+    { 942, Group_UserSettings, "Nut Thread Pitch", "mm", Format_Decimal, "#0.000", "0", "10", Setting_IsExtended, &my_settings.thread_pitch, NULL, NULL },
+    { 943, Group_UserSettings, "Thread Overfeed", "%", Format_Int8, "#0", "0", "50", Setting_IsExtended, &my_settings.thread_overfeed, NULL, NULL },
+    { 944, Group_UserSettings, "Spindle Spin-up Delay", "ms", Format_Int16, "####0", "0", "20000", Setting_IsExtended, &my_settings.spinup_delay, NULL, NULL },
+    { 945, Group_UserSettings, "Spindle Spin-down Delay", "ms", Format_Int16, "####0", "0", "20000", Setting_IsExtended, &my_settings.spindown_delay, NULL, NULL },
+    { 946, Group_UserSettings, "Dust Cover Output Delay", "ms", Format_Int16, "####0", "0", "20000", Setting_IsExtended, &my_settings.dust_cover_delay, NULL, NULL },
+    { 947, Group_UserSettings, "Rows", NULL, Format_Int8, "#0", "0", "24", Setting_IsExtended, &my_settings.rows, NULL, NULL },
+    { 948, Group_UserSettings, "Row Offset", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.row_offset, NULL, NULL },
+    ATC_RACK_SETTINGS(2, 949),
+    ATC_RACK_SETTINGS(3, 958),
+    ATC_RACK_SETTINGS(4, 967),
+    { 976, Group_UserSettings, "Keep-out Margin", "mm", Format_Decimal, "##0.000", "0", "100", Setting_IsExtended, &my_settings.keepout_margin, NULL, NULL },
+    ATC_KEEPOUT_SETTINGS(1, 977),
+    ATC_KEEPOUT_SETTINGS(2, 982),
+    ATC_KEEPOUT_SETTINGS(3, 987),
+    ATC_KEEPOUT_SETTINGS(4, 992),
+    { 997, Group_UserSettings, "Lookahead", NULL, Format_RadioButtons, "Disabled, Enabled", NULL, NULL, Setting_IsExtended, &my_settings.lookahead, NULL, NULL },
+    { 998, Group_UserSettings, "Manual Change X Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.manual_x_pos, NULL, NULL },
+    { 999, Group_UserSettings, "Manual Change Y Position", "mm", Format_Decimal, "-###0.000", "-9999.999", "9999.999", Setting_IsExtended, &my_settings.manual_y_pos, NULL, NULL }
 
 };
 
@@ -155,14 +709,40 @@ static const setting_descr_t user_descriptions[] = {
     { 923, "Value: Y Machine Coordinate (mm)\\n\\nThe Y position referencing the center of the tool setter." },
     { 924, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position at which to begin the initial straight probe." },
     { 925, "Value: Z Machine Coordinate (mm)\\n\\nThe minimum Z position at which it is safe to move above the tool setter with a tool." },
-    { 926, "Value: Input Number\\n\\nThe input pin designation for reading the tool recognition sensor state." },
+    { 926, "Value: Input Number\\n\\nThe input pin designation for reading the tool recognition sensor state. When the input supports interrupts the Z positions at which the sensor changes state are latched while the spindle keeps rising, otherwise the spindle stops at zone 2 to read the sensor." },
     { 927, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position for recognizing the presence of a clamping nut attached to the spindle." },
     { 928, "Value: Z Machine Coordinate (mm)\\n\\nThe Z position for recognizing the complete threading of a clamping nut after picking up a tool." },
     { 929, "Value: A Axis, B Axis, or C Axis\\n\\nThe axis assigned for dust cover control. This is required to control the dust cover with an axis." },
     { 930, "Value: A, B, or C Machine Coordinate (mm)\\n\\nThe position along the assigned axis at which the dust cover is fully open." },
     { 931, "Value: A, B, or C Machine Coordinate (mm)\\n\\nThe position along the assigned axis at which the dust cover is fully closed." },
     { 932, "Value: Output Number\\n\\nThe output pin designation for dust cover control. This is required to control the dust cover with a third-party microcontroller." },
-    { 933, "Testing" }
+    { 933, "Testing" },
+    { 934, "Value: Enabled or Disabled\\n\\nUnloads the current tool and loads the next one in a single pass, staying at the traverse height between the drop-off and the pickup pocket instead of returning to safe clearance." },
+    { 935, "Value: Tool pocket or Nearest free\\n\\nThe pocket the current tool is dropped in. Tool pocket returns it to the pocket it is assigned to, Nearest free uses the free pocket nearest to the pocket of the next tool and updates the assignment. Use $ATCMAP to list or edit the pocket assignments." },
+    { 936, "Value: Off, Phases or All\\n\\nThe tool change events recorded in the trace buffer. Phases records the start of each phase, All also records each planned move and spindle change." },
+    { 937, "Value: On request or When idle\\n\\nWhen idle outputs recorded trace events while no tool change is in progress, On request only outputs them with the $ATCTRACE command." },
+    { 938, "Value: Enabled or Disabled\\n\\nKeeps the tool change timing statistics reported by $ATCSTATS across restarts. The statistics are written after each tool change." },
+    { 939, "Value: Enabled or Disabled\\n\\nApplies the length of a tool measured on the tool setter before on later loads of the same tool instead of probing again. Use $ATCTLO to list the cached lengths or to force a tool to be measured again." },
+    { 940, "Value: Count\\n\\nThe number of tool changes after which a cached tool length expires and the tool is measured again, 0 to never expire." },
+    { 941, "Value: Distance (mm)\\n\\nWhen the expected length of the tool is known from an earlier measurement or from the tool table, the tool rapids to this distance above the expected contact and only seeks the tool setter within this distance of it. Falls back to seeking from Setter Z Start when no contact is made. The margin must cover the uncertainty of the expected length, 0 disables." },
+    { 942, "Value: Distance (mm)\\n\\nThe thread pitch of the clamping nut. When set the spindle engages the nut at a feed rate of the spindle rpm times the pitch instead of the Tool Engagement Feed Rate, 0 disables." },
+    { 943, "Value: Percentage\\n\\nThe amount by which the feed rate derived from the thread pitch is increased so the spindle keeps pressing on the nut while threading." },
+    { 944, "Value: Time (ms)\\n\\nThe time to wait for the spindle to reach the engagement rpm before plunging, for spindles that do not report when they are at speed. Spindles that do report it plunge as soon as they are at speed." },
+    { 945, "Value: Time (ms)\\n\\nThe time the spindle takes to stop. The spindle is stopped at the start of the tool change and decelerates while moving to the magazine, only the descent into the pocket waits for the remaining time." },
+    { 946, "Value: Time (ms)\\n\\nThe time the dust cover takes to open when controlled by an output. The cover is opened when moving to the magazine, only the descent into the pocket waits for the remaining time. A cover on an axis opens as part of the move to the pocket." },
+    { 947, "Value: Count\\n\\nThe number of rows the pockets of the magazine are arranged in, pockets are numbered along each row first. 0 or 1 for a single row. Racks 2 to 4 are set up by settings 949 to 975." },
+    { 948, "Value: Distance (mm)\\n\\nThe distance from one row of the magazine to the next across the alignment axis, negative when the rows are in the negative direction." },
+    ATC_RACK_DESCRIPTIONS(2, 949),
+    ATC_RACK_DESCRIPTIONS(3, 958),
+    ATC_RACK_DESCRIPTIONS(4, 967),
+    { 976, "Value: Distance (mm)\\n\\nThe clearance kept around the keep-out boxes, it should cover the radius and the stick-out of the largest tool. When a keep-out box is set moves between the work area, the magazine and the tool setter are planned around the boxes and above each rack at its traverse height, with diagonal moves and without climbing to Safe Clearance where possible." },
+    ATC_KEEPOUT_DESCRIPTIONS(1, 977),
+    ATC_KEEPOUT_DESCRIPTIONS(2, 982),
+    ATC_KEEPOUT_DESCRIPTIONS(3, 987),
+    ATC_KEEPOUT_DESCRIPTIONS(4, 992),
+    { 997, "Value: Enabled or Disabled\\n\\nPlan the pockets of the next tool change when the next tool is selected with a T word ahead of M6, or when the program ends. The tool change then starts with a move to the first pocket that climbs from the last retract of the program instead of rising vertically to the travel height first, when the spindle is above the racks. The moves from the work area to the magazine should be clear of fixtures above the retract height." },
+    { 998, "Value: X Machine Coordinate (mm)\\n\\nThe X position the spindle is parked at, at Safe Clearance, for the operator to change a tool that has no pocket by hand." },
+    { 999, "Value: Y Machine Coordinate (mm)\\n\\nThe Y position the spindle is parked at, at Safe Clearance, for the operator to change a tool that has no pocket by hand." }
 };
 
 static setting_details_t setting_details = {
@@ -177,10 +757,337 @@ static setting_details_t setting_details = {
     .n_descriptions = sizeof(user_descriptions) / sizeof(setting_descr_t)
 };
 
+static inline uint_fast16_t tool_hash (uint32_t tool_id)
+{
+    return (uint32_t)(tool_id * 2654435761UL) >> (32 - ATC_TOOL_HASH_BITS);
+}
+
+// Rebuild the tool to pocket index, must be called whenever the map or the number of pockets changes.
+static void pocket_map_index (void)
+{
+    uint_fast16_t pocket, slot;
+
+    memset(tool_index, 0, sizeof(tool_index));
+
+    // Pockets may have moved.
+    lookahead.valid = false;
+
+    for(pocket = 0; pocket < geometry.n_pockets; pocket++) {
+        if(pocket_map.tool_id[pocket]) {
+            slot = tool_hash(pocket_map.tool_id[pocket]);
+            while(tool_index[slot])
+                slot = (slot + 1) & (ATC_TOOL_HASH_SIZE - 1);
+            tool_index[slot] = pocket + 1;
+        }
+    }
+}
+
+// Get the pocket a tool is assigned to, ATC_NO_POCKET if none.
+static uint16_t pocket_for_tool (uint32_t tool_id)
+{
+    uint_fast16_t slot = tool_hash(tool_id);
+
+    if(tool_id) while(tool_index[slot]) {
+        if(pocket_map.tool_id[tool_index[slot] - 1] == tool_id)
+            return tool_index[slot] - 1;
+        slot = (slot + 1) & (ATC_TOOL_HASH_SIZE - 1);
+    }
+
+    return ATC_NO_POCKET;
+}
+
+static void report_nvs_lost (uint_fast16_t state)
+{
+    char msg[64];
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < n_lost; idx++) {
+        strcpy(msg, "ATC: ");
+        strcat(msg, nvs_lost[idx].name);
+        strcat(msg, nvs_lost[idx].discarded ? " discarded" : " not kept, no NVS storage");
+        report_message(msg, Message_Warning);
+    }
+
+    n_lost = 0;
+}
+
+static void nvs_report_lost (const char *name, bool discarded)
+{
+    if(n_lost < sizeof(nvs_lost) / sizeof(nvs_lost[0])) {
+        nvs_lost[n_lost].name = name;
+        nvs_lost[n_lost].discarded = discarded;
+        if(n_lost++ == 0)
+            protocol_enqueue_rt_command(report_nvs_lost);
+    }
+}
+
+// Allocate an optional block with a version byte ahead of it, the data is not kept if there is no room left.
+static nvs_address_t nvs_block_alloc (size_t size, const char *name)
+{
+    nvs_address_t address;
+
+    if((address = nvs_alloc(size + 1)) == 0)
+        nvs_report_lost(name, false);
+
+    return address;
+}
+
+static void nvs_block_save (nvs_address_t address, void *block, size_t size, uint8_t version)
+{
+    if(address) {
+        hal.nvs.put_byte(address, version);
+        hal.nvs.memcpy_to_nvs(address + 1, (uint8_t *)block, size, true);
+    }
+}
+
+// Read a stored block. When it fails the checksum or was written with another version the block
+// is cleared and written back, so that it is reported once, and false is returned.
+static bool nvs_block_load (nvs_address_t address, void *block, size_t size, uint8_t version, const char *name)
+{
+    if(address && hal.nvs.get_byte(address) == version &&
+        hal.nvs.memcpy_from_nvs((uint8_t *)block, address + 1, size, true) == NVS_TransferResult_OK)
+        return true;
+
+    memset(block, 0, size);
+
+    if(address) {
+        nvs_report_lost(name, true);
+        nvs_block_save(address, block, size, version);
+    }
+
+    return false;
+}
+
+static void pocket_map_save (void)
+{
+    nvs_block_save(map_address, &pocket_map, ATC_MAP_NVS, ATC_MAP_VERSION);
+}
+
+// Assign tool N to pocket N, the layout used before pocket assignments were introduced.
+static void pocket_map_restore (void)
+{
+    uint_fast16_t pocket;
+
+    for(pocket = 0; pocket < ATC_MAX_POCKETS; pocket++)
+        pocket_map.tool_id[pocket] = pocket + 1;
+
+    pocket_map_save();
+    pocket_map_index();
+}
+
+// Load the tools of the pockets kept in NVS, the pockets above them have tool N in pocket N.
+static void pocket_map_load (void)
+{
+    uint_fast16_t pocket;
+
+    if(nvs_block_load(map_address, &pocket_map, ATC_MAP_NVS, ATC_MAP_VERSION, "pocket map")) {
+        for(pocket = ATC_NVS_POCKETS; pocket < ATC_MAX_POCKETS; pocket++)
+            pocket_map.tool_id[pocket] = pocket + 1;
+        pocket_map_index();
+    } else
+        pocket_map_restore();
+}
+
+static void tlo_cache_save (void)
+{
+    nvs_block_save(tlo_address, &tlo_cache, sizeof(atc_tlo_cache_t), ATC_TLO_VERSION);
+}
+
+static void tlo_cache_load (void)
+{
+    nvs_block_load(tlo_address, &tlo_cache, sizeof(atc_tlo_cache_t), ATC_TLO_VERSION, "tool lengths");
+}
+
+static void occupancy_save (void)
+{
+    nvs_block_save(occupancy_address, &occupancy, sizeof(atc_occupancy_t), ATC_OCCUPANCY_VERSION);
+}
+
+static void occupancy_load (void)
+{
+    nvs_block_load(occupancy_address, &occupancy, sizeof(atc_occupancy_t), ATC_OCCUPANCY_VERSION, "pocket occupancy");
+}
+
+static void checkpoint_load (void)
+{
+    nvs_block_load(checkpoint_address, &checkpoint, sizeof(atc_checkpoint_t), ATC_CHECKPOINT_VERSION, "checkpoint");
+}
+
+// Write the pending checkpoint, unchanged checkpoints are not written again.
+static void checkpoint_save (void)
+{
+    checkpoint_pending = false;
+    checkpoint_next.changes = tool_changes;
+
+    if(checkpoint_address && memcmp(&checkpoint, &checkpoint_next, sizeof(atc_checkpoint_t))) {
+        memcpy(&checkpoint, &checkpoint_next, sizeof(atc_checkpoint_t));
+        nvs_block_save(checkpoint_address, &checkpoint, sizeof(atc_checkpoint_t), ATC_CHECKPOINT_VERSION);
+    }
+}
+
+static inline bool pocket_occupied (uint16_t pocket)
+{
+    return !!(occupancy.occupied[pocket >> 3] & (1 << (pocket & 7)));
+}
+
+static void pocket_set_occupied (uint16_t pocket, bool occupied)
+{
+    if(occupied)
+        occupancy.occupied[pocket >> 3] |= 1 << (pocket & 7);
+    else
+        occupancy.occupied[pocket >> 3] &= ~(1 << (pocket & 7));
+}
+
+// CRC-16/CCITT
+static uint16_t settings_crc (const uint8_t *data, uint_fast16_t size)
+{
+    uint_fast8_t bit;
+    uint16_t crc = 0xFFFF;
+
+    while(size--) {
+        crc ^= (uint16_t)*data++ << 8;
+        for(bit = 0; bit < 8; bit++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+
+    return crc;
+}
+
+// Pack the settings into an image, returns the image size.
+static uint_fast16_t settings_pack (uint8_t *image)
+{
+    uint_fast8_t idx;
+    uint_fast16_t length = ATC_SETTINGS_HEADER;
+    uint16_t crc;
+
+    for(idx = 0; idx < sizeof(settings_fields) / sizeof(atc_settings_field_t); idx++) {
+        memcpy(&image[length], (uint8_t *)&my_settings + settings_fields[idx].offset, settings_fields[idx].size);
+        length += settings_fields[idx].size;
+    }
+
+    image[0] = ATC_SETTINGS_MAGIC;
+    image[1] = ATC_SETTINGS_VERSION;
+    image[2] = (length - ATC_SETTINGS_HEADER) & 0xFF;
+    image[3] = (length - ATC_SETTINGS_HEADER) >> 8;
+
+    crc = settings_crc(&image[1], length - 1);
+    image[length++] = crc & 0xFF;
+    image[length++] = crc >> 8;
+
+    return length;
+}
+
+// Unpack an image written by this or an earlier version, fields not in the image are left unchanged.
+static bool settings_unpack (const uint8_t *image)
+{
+    uint_fast8_t idx;
+    uint_fast16_t length, offset = ATC_SETTINGS_HEADER;
+
+    length = image[2] | (image[3] << 8);
+
+    if(image[0] != ATC_SETTINGS_MAGIC || image[1] < 2 || image[1] > ATC_SETTINGS_VERSION ||
+        length > ATC_SETTINGS_NVS - ATC_SETTINGS_HEADER - 2 ||
+         settings_crc(&image[1], length + ATC_SETTINGS_HEADER - 1) != (image[length + ATC_SETTINGS_HEADER] | (image[length + ATC_SETTINGS_HEADER + 1] << 8)))
+        return false;
+
+    length += ATC_SETTINGS_HEADER;
+
+    for(idx = 0; idx < sizeof(settings_fields) / sizeof(atc_settings_field_t) && offset + settings_fields[idx].size <= length; idx++) {
+        memcpy((uint8_t *)&my_settings + settings_fields[idx].offset, &image[offset], settings_fields[idx].size);
+        offset += settings_fields[idx].size;
+    }
+
+    return true;
+}
+
+// Write the settings image, only bytes that differ from what is in NVS are written.
+static void settings_write (void)
+{
+    uint8_t image[ATC_SETTINGS_NVS];
+    uint_fast16_t idx, length = settings_pack(image);
+
+    if(nvs_address == 0)
+        return;
+
+    for(idx = 0; idx < length; idx++) {
+        if(image[idx] != settings_image[idx]) {
+            hal.nvs.put_byte(nvs_address + idx, image[idx]);
+            settings_image[idx] = image[idx];
+        }
+    }
+}
+
+static float settings_legacy_float (const uint8_t *legacy, size_t offset)
+{
+    float value;
+
+    memcpy(&value, &legacy[offset], sizeof(float));
+
+    return isnan(value) ? 0.0f : value;
+}
+
+// Convert settings written by a release without a versioned image. Those releases had no pocket map,
+// tool N was in pocket N as the restored map assigns.
+static bool settings_migrate_legacy (void)
+{
+    uint8_t raw[sizeof(plugin_settings_legacy_t)];
+    plugin_settings_legacy_t legacy;
+
+    if(settings_image[0] == ATC_SETTINGS_MAGIC ||
+        hal.nvs.memcpy_from_nvs(raw, nvs_address, sizeof(plugin_settings_legacy_t), true) != NVS_TransferResult_OK)
+        return false;
+
+    memcpy(&legacy, raw, sizeof(plugin_settings_legacy_t));
+
+    my_settings.alignment = legacy.alignment;
+    my_settings.direction = legacy.direction;
+    my_settings.number_of_pockets = legacy.number_of_pockets;
+    my_settings.pocket_offset = legacy.pocket_offset;
+    my_settings.pocket_1_x_pos = legacy.pocket_1_x_pos;
+    my_settings.pocket_1_y_pos = legacy.pocket_1_y_pos;
+    my_settings.origin = legacy.origin;
+    my_settings.tool_engagement_feed_rate = legacy.tool_engagement_feed_rate;
+    my_settings.tool_pickup_rpm = legacy.tool_pickup_rpm;
+    my_settings.tool_dropoff_rpm = legacy.tool_dropoff_rpm;
+    // Decimal settings were kept in 16 bit fields and read and written as floats spilling into the next field.
+    my_settings.tool_z_engagement = settings_legacy_float(raw, offsetof(plugin_settings_legacy_t, tool_z_engagement));
+    my_settings.tool_z_traverse = settings_legacy_float(raw, offsetof(plugin_settings_legacy_t, tool_z_traverse));
+    my_settings.tool_z_safe_clearance = settings_legacy_float(raw, offsetof(plugin_settings_legacy_t, tool_z_safe_clearance));
+    my_settings.tool_z_retract = legacy.tool_z_retract;
+    my_settings.tool_start_height = legacy.tool_start_height;
+    my_settings.tool_setter = legacy.tool_setter;
+    my_settings.tool_recognition = legacy.tool_recognition;
+    my_settings.dust_cover = legacy.dust_cover;
+    // 8 bit settings kept in 16 bit fields only used the low byte.
+    my_settings.toolsetter_offset = legacy.toolsetter_offset & 0xFF;
+    my_settings.toolsetter_seek_rate = legacy.toolsetter_seek_rate & 0xFF;
+    my_settings.toolsetter_retreat = legacy.toolsetter_retreat & 0xFF;
+    my_settings.toolsetter_feed_rate = legacy.toolsetter_feed_rate;
+    my_settings.toolsetter_max_travel = legacy.toolsetter_max_travel & 0xFF;
+    my_settings.toolsetter_x_pos = legacy.toolsetter_x_pos;
+    my_settings.toolsetter_y_pos = legacy.toolsetter_y_pos;
+    my_settings.toolsetter_z_start_pos = legacy.toolsetter_z_start_pos;
+    my_settings.toolsetter_safe_z = legacy.toolsetter_safe_z;
+    my_settings.toolrecognition_input = legacy.toolrecognition_input;
+    my_settings.toolrecognition_detect_zone_1 = legacy.toolrecognition_detect_zone_1;
+    my_settings.toolrecognition_detect_zone_2 = legacy.toolrecognition_detect_zone_2;
+    my_settings.dust_cover_axis = legacy.dust_cover_axis;
+    my_settings.dust_cover_open_position = legacy.dust_cover_open_position;
+    my_settings.dust_cover_closed_position = legacy.dust_cover_closed_position;
+    my_settings.dust_cover_output = legacy.dust_cover_output;
+    my_settings.port = legacy.port;
+
+    return true;
+}
+
 // Write settings to non volatile storage (NVS).
 static void plugin_settings_save (void)
 {
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&my_settings, sizeof(plugin_settings_t), true);
+    settings_write();
+
+    geometry_compile();
+    if(geometry.status != Status_OK)
+        report_message(geometry.error, Message_Warning);
 }
 
 static bool is_setting_available (const setting_detail_t *setting)
@@ -199,8 +1106,7 @@ static bool is_setting_available (const setting_detail_t *setting)
     return ok;
 }
 
-// Restore default settings and write to non volatile storage (NVS).
-static void plugin_settings_restore (void)
+static void settings_defaults (void)
 {
     my_settings.alignment = 0;  // 0 = X, 1 = Y
     my_settings.direction = 0;  // 0 = +, 1 = -
@@ -228,6 +1134,12 @@ static void plugin_settings_restore (void)
     my_settings.toolsetter_y_pos = 0;
     my_settings.toolsetter_z_start_pos = 0;
     my_settings.toolsetter_safe_z = 0;
+    my_settings.toolsetter_margin = 0.0f;
+    my_settings.thread_pitch = 0.0f;
+    my_settings.thread_overfeed = 5;
+    my_settings.spinup_delay = 0;
+    my_settings.spindown_delay = 0;
+    my_settings.dust_cover_delay = 0;
     my_settings.toolrecognition_input = 0;
     my_settings.toolrecognition_detect_zone_1 = 0;
     my_settings.toolrecognition_detect_zone_2 = 0;
@@ -236,249 +1148,2799 @@ static void plugin_settings_restore (void)
     my_settings.dust_cover_closed_position = 0;
     my_settings.dust_cover_output = 0;
     my_settings.port = 0;
+    my_settings.swap_mode = false;
+    my_settings.dropoff_policy = DropOff_ToolPocket;
+    my_settings.trace_level = Trace_Off;
+    my_settings.trace_when_idle = false;
+    my_settings.persist_stats = false;
+    my_settings.tlo_cache = false;
+    my_settings.tlo_cache_expiry = 0;
+    my_settings.rows = 1;
+    my_settings.row_offset = 0.0f;
+    memset(my_settings.rack, 0, sizeof(my_settings.rack));
+    my_settings.keepout_margin = 0.0f;
+    memset(my_settings.keepout, 0, sizeof(my_settings.keepout));
+    my_settings.lookahead = false;
+    my_settings.manual_x_pos = 0.0f;
+    my_settings.manual_y_pos = 0.0f;
+}
+
+// Restore default settings and write to non volatile storage (NVS).
+static void plugin_settings_restore (void)
+{
+    settings_defaults();
+    settings_write();
+
+    pocket_map_restore();
+
+    memset(&tlo_cache, 0, sizeof(atc_tlo_cache_t));
+    tlo_cache_save();
+
+    memset(&occupancy, 0, sizeof(atc_occupancy_t));
+    occupancy_save();
+
+    memset(&checkpoint_next, 0, sizeof(atc_checkpoint_t));
+    checkpoint_save();
+
+    geometry_compile();
+}
+
+// Claim the ports enabled by the settings, a port once claimed is kept as changing it takes a reboot.
+static void ports_claim (void)
+{
+    if(latch.port == ATC_NO_PORT && my_settings.tool_recognition && ioport_can_claim_explicit()) {
+        uint8_t input = my_settings.toolrecognition_input;
+        if(ioport_claim(Port_Digital, Port_Input, &input, "ATC tool recognition")) {
+            latch.port = input;
+            latch.irq = hal.port.register_interrupt_handler && hal.port.register_interrupt_handler(input, IRQ_Mode_Change, recognition_irq);
+        }
+    }
 
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&my_settings, sizeof(plugin_settings_t), true);
+    if(cover_port == ATC_NO_PORT && my_settings.dust_cover && my_settings.dust_cover_axis == 0 && ioport_can_claim_explicit()) {
+        uint8_t output = my_settings.dust_cover_output;
+        if(ioport_claim(Port_Digital, Port_Output, &output, "ATC dust cover"))
+            cover_port = output;
+    }
 }
 
 // Load settings from volatile storage (NVS)
 static void plugin_settings_load (void)
 {
-    if(hal.nvs.memcpy_from_nvs((uint8_t *)&my_settings, nvs_address, sizeof(plugin_settings_t), true) != NVS_TransferResult_OK)
+    // Fields missing from an image written by an earlier version keep their defaults.
+    settings_defaults();
+
+    if(nvs_address && hal.nvs.memcpy_from_nvs(settings_image, nvs_address, ATC_SETTINGS_NVS, false) == NVS_TransferResult_OK &&
+        settings_unpack(settings_image))
+        pocket_map_load();
+    else if(nvs_address && settings_migrate_legacy()) {
+        settings_write();
+        pocket_map_restore();
+    } else
         plugin_settings_restore();
+
+    if(!(my_settings.persist_stats && nvs_block_load(stats_address, &stats, sizeof(atc_stats_t), ATC_STATS_VERSION, "statistics")))
+        memset(&stats, 0, sizeof(atc_stats_t));
+
+    tlo_cache_load();
+    occupancy_load();
+    checkpoint_load();
+    tool_changes = checkpoint.changes;
+
+    geometry_compile();
+    ports_claim();
+
+    if(map_address && geometry.n_pockets > ATC_NVS_POCKETS)
+        nvs_report_lost("pockets over ATC_NVS_POCKETS", false);
 }
 
-// Return X,Y based on tool number
-static coord_data_t get_tool_location(tool_data_t tool) {
+// Return X,Y based on the index of a pocket in a rack, computed from the settings
+static coord_data_t pocket_location (const atc_rack_settings_t *rack, uint16_t pocket) {
     coord_data_t target = {0};
+    uint16_t columns = rack->rows > 1 ? (rack->pockets + rack->rows - 1) / rack->rows : rack->pockets;
+    float along = (float)(pocket % columns) * rack->pocket_offset, across = (float)(pocket / columns) * rack->row_offset;
 
     memset(&target, 0, sizeof(coord_data_t)); // Zero plan_data struct
 
-    if(my_settings.alignment == 0) { // X Axis
-        if(my_settings.direction == 0) { // Positive
-            target.x = my_settings.pocket_1_x_pos + (float) ((tool.tool_id - 1) * my_settings.pocket_offset );
+    if(rack->alignment == 0) { // X Axis
+        if(rack->direction == 0) { // Positive
+            target.x = rack->pocket_1_x_pos + along;
         } else {
-            target.x = my_settings.pocket_1_x_pos - (float) ((tool.tool_id - 1) * my_settings.pocket_offset );
+            target.x = rack->pocket_1_x_pos - along;
         }
-        target.y = my_settings.pocket_1_y_pos;
+        target.y = rack->pocket_1_y_pos + across;
     } else {
-        if(my_settings.direction == 0) { // Positive
-            target.y = my_settings.pocket_1_y_pos + (float) ((tool.tool_id - 1) * my_settings.pocket_offset );
+        if(rack->direction == 0) { // Positive
+            target.y = rack->pocket_1_y_pos + along;
         } else {
-            target.y = my_settings.pocket_1_y_pos - (float) ((tool.tool_id - 1) * my_settings.pocket_offset );
+            target.y = rack->pocket_1_y_pos - along;
         }
-        target.x = my_settings.pocket_1_x_pos;
+        target.x = rack->pocket_1_x_pos + across;
     }
 
     return target;
 }
 
-//     protocol_buffer_synchronize();
+// Return X,Y based on pocket index
+static coord_data_t get_pocket_location(uint16_t pocket) {
+    coord_data_t target = {0};
 
+    target.x = geometry.x[pocket];
+    target.y = geometry.y[pocket];
 
-// Reset claimed HAL entry points and restore previous tool if needed on soft restart.
-// Called from EXEC_RESET and EXEC_STOP handlers (via HAL).
-static void reset (void)
-{
-    if(next_tool) { //TODO: move to gc_xxx() function?
-        // Restore previous tool if reset is during change
+    return target;
+}
+
+// Z offset of the rack a pocket is in.
+static inline float pocket_z_offset (uint16_t pocket)
+{
+    return geometry.rack[geometry.rack_of[pocket]].z_offset;
+}
+
+static inline bool in_travel (float x, float y, float z)
+{
+    coord_data_t target = {0};
+
+    target.x = x;
+    target.y = y;
+    target.z = z;
+
+    return !settings.limits.flags.soft_enabled || system_check_travel_limits(target.values);
+}
+
+// Check if a straight move stays out of a box, moving along or away from its faces is allowed.
+static bool box_clear (const atc_box_t *box, const float *from, const float *to)
+{
+    uint_fast8_t idx;
+    float t0 = 0.0f, t1 = 1.0f, delta, lo, hi, ta, tb;
+
+    for(idx = X_AXIS; idx <= Z_AXIS; idx++) {
+
+        lo = idx == Z_AXIS ? -INFINITY : box->min[idx];
+        hi = idx == Z_AXIS ? box->top : box->max[idx];
+
+        if((delta = to[idx] - from[idx]) == 0.0f) {
+            if(from[idx] <= lo || from[idx] >= hi)
+                return true;
+        } else {
+            ta = (lo - from[idx]) / delta;
+            tb = (hi - from[idx]) / delta;
+            t0 = max(t0, min(ta, tb));
+            t1 = min(t1, max(ta, tb));
+            if(t0 >= t1)
+                return true;
+        }
+    }
+
+    return false;
+}
+
+// Check if a straight move stays out of all keep-out boxes. Boxes extend down so rising straight up is always clear.
+static bool path_clear (const float *from, const float *to)
+{
+    uint_fast8_t idx;
+
+    if(from[X_AXIS] == to[X_AXIS] && from[Y_AXIS] == to[Y_AXIS] && to[Z_AXIS] >= from[Z_AXIS])
+        return true;
+
+    for(idx = 0; idx < geometry.n_boxes; idx++) {
+        if(!box_clear(&geometry.box[idx], from, to))
+            return false;
+    }
+
+    return true;
+}
+
+// Lowest Z at which a position is out of the keep-out boxes.
+static float keepout_exit_z (const float *position)
+{
+    uint_fast8_t idx;
+    float z = position[Z_AXIS];
+
+    for(idx = 0; idx < geometry.n_boxes; idx++) {
+        if(position[X_AXIS] > geometry.box[idx].min[X_AXIS] && position[X_AXIS] < geometry.box[idx].max[X_AXIS] &&
+            position[Y_AXIS] > geometry.box[idx].min[Y_AXIS] && position[Y_AXIS] < geometry.box[idx].max[Y_AXIS])
+            z = max(z, geometry.box[idx].top);
+    }
+
+    return z;
+}
+
+// Lowest Z at which a move in the XY plane clears the keep-out boxes.
+static float keepout_travel_z (const float *from, const float *to)
+{
+    uint_fast8_t idx;
+    float z = -INFINITY, a[3], b[3];
+
+    for(idx = 0; idx < geometry.n_boxes; idx++) {
+        a[X_AXIS] = from[X_AXIS];
+        a[Y_AXIS] = from[Y_AXIS];
+        b[X_AXIS] = to[X_AXIS];
+        b[Y_AXIS] = to[Y_AXIS];
+        a[Z_AXIS] = b[Z_AXIS] = geometry.box[idx].top - 1.0f;
+        if(!box_clear(&geometry.box[idx], a, b))
+            z = max(z, geometry.box[idx].top);
+    }
+
+    return z;
+}
+
+static status_code_t geometry_error (const char *error, status_code_t status)
+{
+    geometry.error = error;
+
+    return status;
+}
+
+// Check the Z heights are ordered and that the pockets and the tool setter are within the machine travel.
+static status_code_t geometry_check (void)
+{
+    uint_fast8_t idx;
+    uint_fast16_t pocket;
+    float z_offset;
+
+    if(geometry.n_pockets > ATC_MAX_POCKETS)
+        return geometry_error("ATC: Too many pockets", Status_SettingValueOutOfRange);
+
+    for(idx = 0; idx < geometry.n_racks; idx++) {
+        if(geometry.rack[idx].columns > 1 && geometry.rack[idx].pocket_offset <= 0.0f)
+            return geometry_error("ATC: Pocket Offset must be set", Status_SettingValueOutOfRange);
+        if(geometry.rack[idx].columns < geometry.rack[idx].pockets && geometry.rack[idx].row_offset == 0.0f)
+            return geometry_error("ATC: Row Offset must be set", Status_SettingValueOutOfRange);
+    }
+
+    if(!(my_settings.tool_z_safe_clearance >= my_settings.tool_z_traverse &&
+          my_settings.tool_z_traverse >= my_settings.tool_start_height &&
+           my_settings.tool_start_height > my_settings.tool_z_engagement))
+        return geometry_error("ATC: Z heights must be ordered Safe Clearance >= Traverse >= Start Height > Engage", Status_SettingValueOutOfRange);
+
+    if(my_settings.tool_recognition &&
+        !(my_settings.toolrecognition_detect_zone_1 > my_settings.tool_z_engagement && my_settings.toolrecognition_detect_zone_1 <= my_settings.tool_z_safe_clearance &&
+           my_settings.toolrecognition_detect_zone_2 > my_settings.tool_z_engagement && my_settings.toolrecognition_detect_zone_2 <= my_settings.tool_z_safe_clearance))
+        return geometry_error("ATC: Detect zones must be above Engage and not above Safe Clearance", Status_SettingValueOutOfRange);
+
+    if(my_settings.tool_setter) {
+        if(my_settings.toolsetter_safe_z < my_settings.toolsetter_z_start_pos || my_settings.toolsetter_safe_z > my_settings.tool_z_safe_clearance)
+            return geometry_error("ATC: Setter Safe Z must be between Setter Z Start and Safe Clearance", Status_SettingValueOutOfRange);
+        if(!in_travel(my_settings.toolsetter_x_pos, my_settings.toolsetter_y_pos, my_settings.toolsetter_z_start_pos - my_settings.toolsetter_max_travel))
+            return geometry_error("ATC: Tool setter is outside the machine travel", Status_TravelExceeded);
+    }
+
+    for(idx = 0; idx < geometry.n_keepouts; idx++) {
+        if(geometry.box[idx].top > my_settings.tool_z_safe_clearance)
+            return geometry_error("ATC: Keep-out boxes must be below Safe Clearance", Status_SettingValueOutOfRange);
+    }
+
+    if(geometry.n_keepouts && my_settings.tool_setter) {
+        float setter[3] = { my_settings.toolsetter_x_pos, my_settings.toolsetter_y_pos, my_settings.toolsetter_z_start_pos };
+        if(keepout_exit_z(setter) > setter[Z_AXIS])
+            return geometry_error("ATC: Setter Z Start is inside a keep-out box", Status_SettingValueOutOfRange);
+    }
+
+    for(pocket = 0; pocket < geometry.n_pockets; pocket++) {
+        z_offset = pocket_z_offset(pocket);
+        if(geometry.n_keepouts) {
+            float entry[3] = { geometry.x[pocket], geometry.y[pocket], my_settings.tool_z_traverse + z_offset };
+            if(keepout_exit_z(entry) > entry[Z_AXIS])
+                return geometry_error("ATC: Pocket is inside a keep-out box", Status_SettingValueOutOfRange);
+        }
+        if(!(in_travel(geometry.x[pocket], geometry.y[pocket], my_settings.tool_z_engagement + z_offset) &&
+              in_travel(geometry.x[pocket], geometry.y[pocket], my_settings.tool_z_safe_clearance) &&
+               my_settings.tool_z_traverse + z_offset <= my_settings.tool_z_safe_clearance))
+            return geometry_error("ATC: Pocket is outside the machine travel", Status_TravelExceeded);
+    }
+
+    geometry.error = NULL;
+
+    return Status_OK;
+}
+
+// Compute the pocket positions of all racks and validate the geometry, must be called whenever the settings change.
+// Pockets are numbered through the racks in order. A tool change is refused before moving if the geometry is invalid.
+static void geometry_compile (void)
+{
+    uint_fast8_t idx;
+    uint_fast16_t pocket;
+    coord_data_t location;
+    atc_rack_settings_t rack;
+    atc_rack_t *compiled;
+    atc_box_t *box;
+
+    geometry.n_pockets = geometry.n_racks = 0;
+
+    for(idx = 0; idx < ATC_MAX_RACKS; idx++) {
+
+        if(idx == 0) {
+            rack.pockets = my_settings.number_of_pockets;
+            rack.rows = my_settings.rows;
+            rack.alignment = my_settings.alignment;
+            rack.direction = my_settings.direction;
+            rack.pocket_offset = (float)my_settings.pocket_offset;
+            rack.row_offset = my_settings.row_offset;
+            rack.pocket_1_x_pos = my_settings.pocket_1_x_pos;
+            rack.pocket_1_y_pos = my_settings.pocket_1_y_pos;
+            rack.z_offset = 0.0f;
+        } else
+            memcpy(&rack, &my_settings.rack[idx - 1], sizeof(atc_rack_settings_t));
+
+        if(rack.pockets == 0)
+            continue;
+
+        compiled = &geometry.rack[geometry.n_racks];
+        compiled->first = geometry.n_pockets;
+        compiled->pockets = rack.pockets;
+        compiled->columns = rack.rows > 1 ? (rack.pockets + rack.rows - 1) / rack.rows : rack.pockets;
+        compiled->axis = rack.alignment == 0 ? X_AXIS : Y_AXIS;
+        compiled->direction = rack.direction == 0 ? 1.0f : -1.0f;
+        compiled->pocket_offset = rack.pocket_offset;
+        compiled->row_offset = rack.row_offset;
+        compiled->z_offset = rack.z_offset;
+
+        for(pocket = 0; pocket < rack.pockets && geometry.n_pockets < ATC_MAX_POCKETS; pocket++) {
+            location = pocket_location(&rack, pocket);
+            geometry.x[geometry.n_pockets] = location.x;
+            geometry.y[geometry.n_pockets] = location.y;
+            geometry.rack_of[geometry.n_pockets++] = geometry.n_racks;
+        }
+
+        geometry.n_racks++;
+
+        // Count the pockets that do not fit so the check can report it.
+        if(pocket < rack.pockets)
+            geometry.n_pockets += rack.pockets - pocket;
+    }
+
+    // Keep-out boxes followed by a box over the pockets of each rack, the spindle may move over a rack at its traverse height.
+    geometry.n_boxes = 0;
+
+    for(idx = 0; idx < ATC_MAX_KEEPOUTS; idx++) {
+        atc_keepout_settings_t *keepout = &my_settings.keepout[idx];
+        if(keepout->x_max > keepout->x_min && keepout->y_max > keepout->y_min) {
+            box = &geometry.box[geometry.n_boxes++];
+            box->min[X_AXIS] = keepout->x_min - my_settings.keepout_margin;
+            box->max[X_AXIS] = keepout->x_max + my_settings.keepout_margin;
+            box->min[Y_AXIS] = keepout->y_min - my_settings.keepout_margin;
+            box->max[Y_AXIS] = keepout->y_max + my_settings.keepout_margin;
+            box->top = keepout->z_top + my_settings.keepout_margin;
+        }
+    }
+
+    geometry.n_keepouts = geometry.n_boxes;
+    geometry.z_traverse = my_settings.tool_z_traverse;
+
+    for(idx = 0; idx < geometry.n_racks; idx++) {
+        compiled = &geometry.rack[idx];
+        box = &geometry.box[geometry.n_boxes++];
+        box->min[X_AXIS] = box->min[Y_AXIS] = INFINITY;
+        box->max[X_AXIS] = box->max[Y_AXIS] = -INFINITY;
+        for(pocket = compiled->first; pocket < compiled->first + compiled->pockets && pocket < ATC_MAX_POCKETS; pocket++) {
+            box->min[X_AXIS] = min(box->min[X_AXIS], geometry.x[pocket]);
+            box->max[X_AXIS] = max(box->max[X_AXIS], geometry.x[pocket]);
+            box->min[Y_AXIS] = min(box->min[Y_AXIS], geometry.y[pocket]);
+            box->max[Y_AXIS] = max(box->max[Y_AXIS], geometry.y[pocket]);
+        }
+        box->min[X_AXIS] -= compiled->pocket_offset / 2.0f + my_settings.keepout_margin;
+        box->max[X_AXIS] += compiled->pocket_offset / 2.0f + my_settings.keepout_margin;
+        box->min[Y_AXIS] -= compiled->pocket_offset / 2.0f + my_settings.keepout_margin;
+        box->max[Y_AXIS] += compiled->pocket_offset / 2.0f + my_settings.keepout_margin;
+        box->top = my_settings.tool_z_traverse + compiled->z_offset;
+        geometry.z_traverse = min(geometry.z_traverse, box->top);
+    }
+
+    geometry.status = geometry_check();
+
+    if(geometry.n_pockets > ATC_MAX_POCKETS)
+        geometry.n_pockets = ATC_MAX_POCKETS;
+
+    // The number of pockets may have changed.
+    pocket_map_index();
+}
+
+// Travel distance between two pockets.
+static inline float pocket_distance (uint16_t a, uint16_t b)
+{
+    return hypotf(geometry.x[a] - geometry.x[b], geometry.y[a] - geometry.y[b]);
+}
+
+static inline bool pocket_is_free (uint16_t pocket)
+{
+    return pocket_map.tool_id[pocket] == 0 || pocket_map.tool_id[pocket] == current_tool.tool_id;
+}
+
+// Select the pocket to drop the current tool in, ATC_NO_POCKET if it has to be unloaded manually.
+static uint16_t dropoff_pocket (uint16_t pick_pocket)
+{
+    uint16_t home = pocket_for_tool(current_tool.tool_id), pocket, nearest = ATC_NO_POCKET;
+    bool manual_load = pick_pocket == ATC_NO_POCKET && next_tool && next_tool->tool_id;
+    float distance, nearest_distance = INFINITY;
+    coord_data_t ref;
+
+    if(current_tool.tool_id == 0 || (home != ATC_NO_POCKET && (my_settings.dropoff_policy == DropOff_ToolPocket || pick_pocket == ATC_NO_POCKET)))
+        return home;
+
+    // A tool without a pocket is staged in a free pocket on the way to a manual change whatever the policy.
+    if(my_settings.dropoff_policy == DropOff_ToolPocket && !manual_load)
+        return home;
+
+    // Free pocket nearest to the pocket of the next tool, to the manual change position when the next tool
+    // has no pocket or to the spindle when there is no next tool, this picks the nearest rack when there are several.
+    if(manual_load) {
+        ref.x = my_settings.manual_x_pos;
+        ref.y = my_settings.manual_y_pos;
+    } else if(pick_pocket == ATC_NO_POCKET)
+        atc_get_position(&ref);
+    else
+        ref = get_pocket_location(pick_pocket);
+
+    for(pocket = 0; pocket < geometry.n_pockets; pocket++) {
+        if(pocket_is_free(pocket) && (distance = hypotf(geometry.x[pocket] - ref.x, geometry.y[pocket] - ref.y)) < nearest_distance) {
+            nearest_distance = distance;
+            nearest = pocket;
+        }
+    }
+
+    return nearest;
+}
+
+// Record the tool dropped in a pocket, the pocket it was assigned to becomes empty.
+static void pocket_map_dropped (uint16_t pocket, uint32_t tool_id)
+{
+    uint16_t home = pocket_for_tool(tool_id);
+
+    if(home == pocket)
+        return;
+
+    if(home != ATC_NO_POCKET)
+        pocket_map.tool_id[home] = 0;
+
+    pocket_map.tool_id[pocket] = tool_id;
+    pocket_map_index();
+
+    pocket_map_save();
+}
+
+// Number of tool changes since the entry was measured, invalid entries are the oldest.
+static inline uint32_t tlo_cache_age (atc_tlo_entry_t *entry)
+{
+    return entry->valid ? tool_changes - entry->stamp : UINT32_MAX;
+}
+
+// Get the last measured length of a tool, valid or not. NULL if the tool has never been measured.
+static atc_tlo_entry_t *tlo_cache_find (uint32_t tool_id)
+{
+    uint_fast8_t idx;
+
+    if(tool_id) for(idx = 0; idx < ATC_TLO_CACHE_SIZE; idx++) {
+        if(tlo_cache.entry[idx].tool_id == tool_id)
+            return &tlo_cache.entry[idx];
+    }
+
+    return NULL;
+}
+
+// Get the cached length of a tool, NULL if the tool has not been measured or the length has expired.
+static atc_tlo_entry_t *tlo_cache_lookup (uint32_t tool_id)
+{
+    atc_tlo_entry_t *entry;
+
+    if(!my_settings.tlo_cache || (entry = tlo_cache_find(tool_id)) == NULL || !entry->valid)
+        return NULL;
+
+    return my_settings.tlo_cache_expiry == 0 || tlo_cache_age(entry) < my_settings.tlo_cache_expiry ? entry : NULL;
+}
+
+// Invalidate the cached length of a tool, of all tools if 0. The length is kept to predict the contact position.
+static void tlo_cache_invalidate (uint32_t tool_id)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < ATC_TLO_CACHE_SIZE; idx++) {
+        if(tool_id == 0 || tlo_cache.entry[idx].tool_id == tool_id)
+            tlo_cache.entry[idx].valid = false;
+    }
+
+    tlo_cache_save();
+}
+
+// Get the expected Z contact position of a tool in steps from its last measured length,
+// or else from the tool table offset relative to the TLO reference.
+static bool tlo_expected (tool_data_t *tool, int32_t *contact)
+{
+    atc_tlo_entry_t *entry;
+
+    if((entry = tlo_cache_find(tool->tool_id))) {
+        *contact = entry->contact;
+        return true;
+    }
+
+    if(sys.tlo_reference_set.z && tool->offset[Z_AXIS] != 0.0f) {
+        *contact = sys.tlo_reference[Z_AXIS] + lroundf(tool->offset[Z_AXIS] * settings.axis[Z_AXIS].steps_per_mm);
+        return true;
+    }
+
+    return false;
+}
+
+// Store a measured tool length, replacing the entry of the same tool or else the oldest one.
+// Lengths are stored even when the cache is disabled, they are used to predict the contact position.
+static void tlo_cache_store (uint32_t tool_id, int32_t contact)
+{
+    uint_fast8_t idx;
+    atc_tlo_entry_t *entry = &tlo_cache.entry[0];
+
+    if(tool_id == 0)
+        return;
+
+    for(idx = 0; idx < ATC_TLO_CACHE_SIZE; idx++) {
+        if(tlo_cache.entry[idx].tool_id == tool_id) {
+            entry = &tlo_cache.entry[idx];
+            break;
+        }
+        if(tlo_cache_age(&tlo_cache.entry[idx]) > tlo_cache_age(entry))
+            entry = &tlo_cache.entry[idx];
+    }
+
+    entry->tool_id = tool_id;
+    entry->contact = contact;
+    entry->stamp = tool_changes;
+    entry->valid = true;
+
+    tlo_cache_save();
+}
+
+// Apply the length of the tool in the spindle as a dynamic tool length offset.
+// The first tool measured after a restart sets the reference, as for the core tool change.
+static void tlo_apply (int32_t contact)
+{
+    if(!sys.tlo_reference_set.z) {
+        sys.tlo_reference[Z_AXIS] = contact;
+        sys.tlo_reference_set.z = On;
+        system_add_rt_report(Report_TLOReference);
+    }
+
+    gc_set_tool_offset(ToolLengthOffset_EnableDynamic, Z_AXIS, contact - sys.tlo_reference[Z_AXIS]);
+}
+
+// Record a trace event. Allocation and formatting free, the event is dropped if the buffer is full.
+// Only the foreground process writes events so the head index has a single producer.
+static void trace_record (const char *message, coord_data_t *target, plan_line_data_t *pl_data)
+{
+    uint_fast16_t head = (trace.head + 1) & (ATC_TRACE_SIZE - 1);
+    atc_trace_event_t *event;
+
+    if(head == trace.tail) {
+        trace.dropped++;
+        return;
+    }
+
+    event = &trace.event[trace.head];
+    event->ms = hal.get_elapsed_ticks();
+    event->message = message;
+    event->phase = sequence.phase;
+    event->flags.target = target != NULL;
+    event->flags.plan = pl_data != NULL;
+
+    if(target)
+        memcpy(event->target, target->values, sizeof(event->target));
+
+    if(pl_data) {
+        event->feed = pl_data->condition.rapid_motion ? 0.0f : pl_data->feed_rate;
+        event->rpm = pl_data->spindle.rpm;
+        event->spindle = pl_data->spindle.state;
+    }
+
+    trace.head = head;
+}
+
+static void trace_event (const char *message, coord_data_t *target, plan_line_data_t *pl_data)
+{
+    if(my_settings.trace_level == Trace_All)
+        trace_record(message, target, pl_data);
+}
+
+// Record the start of a phase.
+static void trace_phase (atc_phase_t phase)
+{
+    if(my_settings.trace_level != Trace_Off)
+        trace_record(phase_name[phase], &sequence.target, NULL);
+}
+
+// Format and output recorded trace events, oldest first. Returns the number of events output.
+static uint_fast16_t trace_drain (uint_fast16_t max_events)
+{
+    uint_fast16_t count = 0;
+    atc_trace_event_t *event;
+
+    if(trace.dropped) {
+        hal.stream.write("[ATCTRACE:dropped ");
+        hal.stream.write(uitoa(trace.dropped));
+        hal.stream.write("]" ASCII_EOL);
+        trace.dropped = 0;
+    }
+
+    while(trace.tail != trace.head && count++ < max_events) {
+
+        event = &trace.event[trace.tail];
+
+        hal.stream.write("[ATCTRACE:");
+        hal.stream.write(uitoa(event->ms));
+        hal.stream.write(",");
+        hal.stream.write(phase_name[event->phase]);
+        hal.stream.write(",");
+        hal.stream.write(event->message);
+
+        if(event->flags.target) {
+            hal.stream.write("|X:");
+            hal.stream.write(ftoa(event->target[X_AXIS], 3));
+            hal.stream.write(",Y:");
+            hal.stream.write(ftoa(event->target[Y_AXIS], 3));
+            hal.stream.write(",Z:");
+            hal.stream.write(ftoa(event->target[Z_AXIS], 3));
+        }
+
+        if(event->flags.plan) {
+            hal.stream.write("|F:");
+            hal.stream.write(event->feed == 0.0f ? "rapid" : ftoa(event->feed, 0));
+            hal.stream.write(",S:");
+            hal.stream.write(ftoa(event->rpm, 0));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(event->spindle.value));
+        }
+
+        hal.stream.write("]" ASCII_EOL);
+
+        trace.tail = (trace.tail + 1) & (ATC_TRACE_SIZE - 1);
+    }
+
+    return count;
+}
+
+// Format the real-time report element, called when the phase or recognition result changes
+// so that the real-time report itself only has to output the preformatted string.
+// |ATC:<phase>,<unload tool>,<load tool>,<pocket>,<recognition>
+static void status_update (void)
+{
+    atc_phase_t phase = timing.active ? timing.phase : sequence.phase;
+    uint16_t pocket;
+    char *s;
+
+    if(phase == ATC_Idle && sequence.phase == ATC_Idle) {
+        *status_field = '\0';
+        return;
+    }
+
+    if(phase == ATC_Recognition)
+        pocket = sequence.load ? sequence.pick_pocket : sequence.drop_pocket;
+    else
+        pocket = phase >= ATC_LoadApproach ? sequence.pick_pocket : sequence.drop_pocket;
+
+    strcpy(status_field, "|ATC:");
+    strcat(status_field, phase_name[phase]);
+    strcat(status_field, ",");
+    strcat(status_field, uitoa(sequence.unload_tool));
+    strcat(status_field, ",");
+    strcat(status_field, uitoa(sequence.load_tool));
+    strcat(status_field, ",");
+    strcat(status_field, uitoa(pocket == ATC_NO_POCKET ? 0 : pocket + 1));
+    s = strchr(status_field, '\0');
+    *s++ = ',';
+    *s++ = sequence.recognition;
+    *s = '\0';
+}
+
+static void atc_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    if(*status_field)
+        stream_write(status_field);
+
+    if(on_realtime_report)
+        on_realtime_report(stream_write, report);
+}
+
+// Microsecond timestamp, falls back to the millisecond tick if the driver has no microsecond clock.
+static inline uint32_t timing_now (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+}
+
+static void stats_add (atc_phase_stats_t *entry, float ms)
+{
+    uint_fast8_t bucket = 0;
+
+    if(entry->count == 0 || ms < entry->min)
+        entry->min = ms;
+    if(ms > entry->max)
+        entry->max = ms;
+
+    entry->sum += ms;
+    entry->count++;
+
+    while(bucket < ATC_STATS_BUCKETS - 1 && ms >= (float)stats_bucket_ms[bucket])
+        bucket++;
+
+    if(entry->histogram[bucket] < UINT16_MAX)
+        entry->histogram[bucket]++;
+}
+
+static void timing_start (void)
+{
+    timing.active = true;
+    timing.phase = ATC_CoolantOff;
+    timing.phase_start = timing.cycle_start = timing_now();
+    timing.block = NULL;
+    timing.runs = 0;
+}
+
+// Record the phase of a planned move. When out of entries the move is counted in the last phase recorded.
+static void timing_planned (atc_phase_t phase)
+{
+    if(!timing.active)
+        return;
+
+    if(timing.runs && (timing.run[timing.runs - 1].phase == phase || timing.runs == ATC_TIMING_RUNS))
+        timing.run[timing.runs - 1].moves++;
+    else {
+        timing.run[timing.runs].phase = phase;
+        timing.run[timing.runs++].moves = 1;
+    }
+}
+
+// Get the phase the machine is executing. The planner blocks form a ring, those from the block executing
+// at the last update up to the current one have completed. When the planner is empty the machine is
+// waiting for the phase being planned.
+static atc_phase_t timing_phase (void)
+{
+    plan_block_t *block = plan_get_current_block();
+
+    if(block == NULL) {
+        timing.block = NULL;
+        timing.runs = 0;
+        return sequence.phase;
+    }
+
+    for(; timing.block && timing.block != block; timing.block = timing.block->next) {
+        if(timing.runs && --timing.run[0].moves == 0) {
+            timing.runs--;
+            memmove(timing.run, timing.run + 1, timing.runs * sizeof(atc_timing_run_t));
+        }
+    }
+
+    timing.block = block;
+
+    // Moves planned before the M6 command count as part of the first phase.
+    return timing.runs ? timing.run[0].phase : timing.phase;
+}
+
+// Called from the realtime loop while a tool change is in progress.
+static void timing_update (void)
+{
+    atc_phase_t phase = timing_phase();
+    uint32_t now = timing_now();
+
+    if(phase != timing.phase) {
+        stats_add(&stats.phase[timing.phase], (float)(now - timing.phase_start) / 1000.0f);
+        timing.phase = phase;
+        timing.phase_start = now;
+        status_update();
+    }
+
+    // The cycle ends when the machine has come to a stop after the last phase.
+    if(phase == ATC_Idle && state_get() == STATE_IDLE) {
+        stats_add(&stats.phase[ATC_STATS_CYCLE], (float)(now - timing.cycle_start) / 1000.0f);
+        timing.active = false;
+        status_update();
+        if(my_settings.persist_stats)
+            nvs_block_save(stats_address, &stats, sizeof(atc_stats_t), ATC_STATS_VERSION);
+    }
+}
+
+// Estimate the time (in minutes) for a single move using a trapezoidal velocity profile.
+// Every move is assumed to start and end at rest, junction blending is ignored.
+static float estimate_move_time (float *from, float *to, plan_line_data_t *pl_data)
+{
+    uint_fast8_t idx;
+    float delta[N_AXIS], distance = 0.0f, unit, rate, accel = SOME_LARGE_VALUE;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        delta[idx] = to[idx] - from[idx];
+        distance += delta[idx] * delta[idx];
+    }
+
+    if((distance = sqrtf(distance)) == 0.0f)
+        return 0.0f;
+
+    rate = pl_data->condition.rapid_motion ? SOME_LARGE_VALUE : pl_data->feed_rate;
+
+    // Limit rate and acceleration to what the slowest contributing axis can do.
+    for(idx = 0; idx < N_AXIS; idx++) {
+        if(delta[idx] != 0.0f) {
+            unit = fabsf(delta[idx]) / distance;
+            rate = min(rate, settings.axis[idx].max_rate / unit);
+            accel = min(accel, settings.axis[idx].acceleration / unit);
+        }
+    }
+
+    if(rate <= 0.0f || accel <= 0.0f)
+        return 0.0f;
+
+    if(distance >= rate * rate / accel)
+        return distance / rate + rate / accel;
+
+    return 2.0f * sqrtf(distance / accel);
+}
+
+// Get the current machine position.
+static void atc_get_position (coord_data_t *position)
+{
+    system_convert_array_steps_to_mpos(position->values, sys.position);
+}
+
+// Plan a move, motion is started once the sequence has planned what it can.
+static bool atc_line (float *target, plan_line_data_t *pl_data)
+{
+    sequence.queued = true;
+    timing_planned(sequence.phase);
+
+    return mc_line(target, pl_data);
+}
+
+// Check if the planner can accept another move.
+static bool atc_can_queue (void)
+{
+    return !plan_check_full_buffer();
+}
+
+// Check if all planned moves are completed.
+static bool atc_synced (void)
+{
+    return plan_get_current_block() == NULL && state_get() == STATE_IDLE;
+}
+
+// Run a straight probe towards the target, on success the target is set to the contact position.
+static bool atc_probe (coord_data_t *target, plan_line_data_t *pl_data)
+{
+    gc_parser_flags_t flags = {0};
+
+    // Failures are reported by the tool change rather than raising an alarm.
+    flags.probe_is_no_error = On;
+    timing_planned(sequence.phase);
+
+    if(mc_probe_cycle(target->values, pl_data, flags) != GCProbe_Found)
+        return false;
+
+    system_convert_array_steps_to_mpos(target->values, sys.probe_position);
+
+    return true;
+}
+
+// Time in ms.
+static uint32_t atc_ms (void)
+{
+    return hal.get_elapsed_ticks();
+}
+
+// Check if a delay started at the given time has elapsed.
+static bool atc_elapsed (uint32_t start, uint16_t delay)
+{
+    return atc_ms() - start >= delay;
+}
+
+// Set the spindle state immediately.
+static void atc_spindle (plan_line_data_t *pl_data, spindle_state_t state, float rpm)
+{
+    pl_data->spindle.state = state;
+    pl_data->spindle.rpm = rpm;
+
+    pl_data->spindle.hal->set_state(pl_data->spindle.hal, state, rpm);
+
+    if(state.on)
+        spindle_on_ms = atc_ms();
+    else
+        spindle_off_ms = atc_ms();
+}
+
+// Check if the spindle is up to speed, as reported by the spindle when supported or else after the spin-up delay.
+static bool atc_spindle_at_speed (plan_line_data_t *pl_data)
+{
+    spindle_ptrs_t *spindle = pl_data->spindle.hal;
+
+    if(spindle->cap.at_speed && spindle->get_state)
+        return spindle->get_state(spindle).at_speed;
+
+    return atc_elapsed(spindle_on_ms, my_settings.spinup_delay);
+}
+
+// Open or close the dust cover. A cover on an axis moves with the next planned move,
+// a cover on an output is switched immediately.
+static void atc_dust_cover (coord_data_t *target, bool open)
+{
+    if(!my_settings.dust_cover)
+        return;
+
+    if(my_settings.dust_cover_axis) {
+#if N_AXIS > 3
+        if(A_AXIS + my_settings.dust_cover_axis - 1 < N_AXIS)
+            target->values[A_AXIS + my_settings.dust_cover_axis - 1] = open ? (float)my_settings.dust_cover_open_position
+                                                                              : (float)my_settings.dust_cover_closed_position;
+#endif
+    } else if(cover_open != open) {
+        if(cover_port != ATC_NO_PORT)
+            hal.port.digital_out(cover_port, open);
+        cover_ms = atc_ms();
+    }
+
+    cover_open = open;
+}
+
+// Check if the dust cover is open, a cover on an output is given the dust cover delay.
+static bool atc_dust_cover_opened (void)
+{
+    return !my_settings.dust_cover || my_settings.dust_cover_axis || atc_elapsed(cover_ms, my_settings.dust_cover_delay);
+}
+
+// Latch the position at which the recognition sensor changed state. Called from the input interrupt.
+static void recognition_irq (uint8_t port, bool state)
+{
+    if(latch.armed && latch.count < latch.size) {
+        latch.edge[latch.count].position = sys.position[latch.axis];
+        latch.edge[latch.count].blocked = state;
+        latch.count++;
+    }
+}
+
+static void recognition_reset (void)
+{
+    latch.armed = false;
+    latch.axis = Z_AXIS;
+    latch.edge = recognition_edge;
+    latch.size = ATC_LATCH_SIZE;
+    latch.count = 0;
+    latch.z_last = INT32_MAX;
+}
+
+// Check if the recognition sweep has passed the top zone, without waiting for motion to complete.
+// Latching is armed once Z starts rising from the engagement height, the sensor state at that point
+// is read so edges missed before arming do not matter as long as it is below the detect zones.
+// On a retry Z may still be rising from the previous sweep, it has to come down to the engagement height first.
+static bool recognition_swept (float z_top)
+{
+    int32_t z;
+
+    if(!latch.irq)
+        return atc_synced();
+
+    z = sys.position[Z_AXIS];
+
+    if(!latch.armed) {
+        if(z > latch.z_last && latch.z_last <= lroundf((my_settings.tool_z_engagement + sequence.z_offset) * settings.axis[Z_AXIS].steps_per_mm)) {
+            latch.initial = laserBlocked();
+            latch.z_armed = z;
+            latch.armed = true;
+        } else
+            latch.z_last = z;
+    }
+
+    return (latch.armed && (float)z / settings.axis[Z_AXIS].steps_per_mm >= z_top) || atc_synced();
+}
+
+// Get the sensor state at a Z position of the last sweep from the latched edges.
+static bool recognition_blocked_at (float z)
+{
+    bool blocked = latch.initial;
+    uint_fast8_t idx, count = latch.count;
+    int32_t z_steps = lroundf(z * settings.axis[Z_AXIS].steps_per_mm);
+
+    for(idx = 0; idx < count && latch.edge[idx].position <= z_steps; idx++)
+        blocked = latch.edge[idx].blocked;
+
+    return blocked;
+}
+
+// Z position at which the clamping nut cleared the sensor during the last sweep, NAN if it did not.
+static float recognition_nut_z (void)
+{
+    uint_fast8_t idx = latch.count;
+
+    while(idx) {
+        if(!latch.edge[--idx].blocked)
+            return (float)latch.edge[idx].position / settings.axis[Z_AXIS].steps_per_mm;
+    }
+
+    return NAN;
+}
+
+// Check the clamping nut after the sweep: it must be present at zone 1 after loading and gone after unloading,
+// and it must have cleared the sensor by zone 2. The state is read directly when edges are not latched.
+static bool recognition_passed (void)
+{
+    coord_data_t nut;
+
+    if(!latch.irq)
+        return !laserBlocked();
+
+    // Edges below the arming position were not latched, sweep again.
+    if(!latch.armed || (float)latch.z_armed / settings.axis[Z_AXIS].steps_per_mm > sequence.z_offset + min(my_settings.toolrecognition_detect_zone_1, my_settings.toolrecognition_detect_zone_2))
+        return false;
+
+    memcpy(&nut, &sequence.target, sizeof(coord_data_t));
+    if(!isnan(nut.z = recognition_nut_z()))
+        trace_event("Clamping nut cleared sensor", &nut, NULL);
+
+    return recognition_blocked_at(my_settings.toolrecognition_detect_zone_1 + sequence.z_offset) == sequence.load &&
+            !recognition_blocked_at(my_settings.toolrecognition_detect_zone_2 + sequence.z_offset);
+}
+
+// Abandon the tool change in progress, the tool last updated as the current tool is kept.
+static void sequence_abort (void)
+{
+    if(next_tool) {
+        // Restore previous tool if reset is during change
+
+        if(current_tool.tool_id != next_tool->tool_id) {
+            memcpy(next_tool, &current_tool, sizeof(tool_data_t));
+            system_add_rt_report(Report_Tool);
+        }
+
+        gc_state.tool_pending = gc_state.tool->tool_id;
+        next_tool = NULL;
+    }
+
+    sequence.phase = ATC_Idle;
+    sequence.path_length = 0;
+    timing.active = false;
+    *status_field = '\0';
+
+    // Motion planned after the last checkpoint may not have completed.
+    checkpoint_pending = false;
+}
+
+// Reset claimed HAL entry points and restore previous tool if needed on soft restart.
+// Called from EXEC_RESET and EXEC_STOP handlers (via HAL).
+static void reset (void)
+{
+    sequence_abort();
+    driver_reset();
+}
+
+// Travel height between the drop-off and the pickup pocket. Stay at the traverse height between pockets
+// of the same rack when unloading and loading in one pass.
+static float sequence_travel_height (uint16_t drop_pocket, uint16_t pick_pocket)
+{
+    return my_settings.swap_mode && drop_pocket != ATC_NO_POCKET && pick_pocket != ATC_NO_POCKET &&
+            geometry.rack_of[drop_pocket] == geometry.rack_of[pick_pocket]
+            ? my_settings.tool_z_traverse + pocket_z_offset(pick_pocket)
+            : my_settings.tool_z_safe_clearance;
+}
+
+// Plan the pockets of the change to the selected tool so M6 can start moving right away.
+// The drop-off pocket is chosen from the position when planned.
+static void lookahead_plan (void)
+{
+    lookahead.valid = false;
+
+    if(!my_settings.lookahead || next_tool == NULL || next_tool->tool_id == current_tool.tool_id ||
+        sequence.phase != ATC_Idle || geometry.status != Status_OK)
+        return;
+
+    lookahead.tool_id = next_tool->tool_id;
+    lookahead.spindle_tool = current_tool.tool_id;
+    lookahead.pick_pocket = pocket_for_tool(lookahead.tool_id);
+    lookahead.drop_pocket = dropoff_pocket(lookahead.pick_pocket);
+    lookahead.z_travel = sequence_travel_height(lookahead.drop_pocket, lookahead.pick_pocket);
+    lookahead.valid = true;
+}
+
+// Set next and/or current tool. Called by gcode.c on on a Tn or M61 command (via HAL).
+static void tool_select (tool_data_t *tool, bool next)
+{
+    next_tool = tool;
+    if(!next)
+        memcpy(&current_tool, tool, sizeof(tool_data_t));
+
+    lookahead_plan();
+}
+
+// Plan the next tool change at the end of the program, the spindle is at its final position.
+static void atc_program_completed (program_flow_t program_flow, bool check_mode)
+{
+    if(!check_mode)
+        lookahead_plan();
+
+    if(on_program_completed)
+        on_program_completed(program_flow, check_mode);
+}
+
+// Feed rate of moves with the spindle running, matched to the thread pitch of the nut when set.
+static float engagement_feed_rate (plan_line_data_t *pl_data)
+{
+    if(my_settings.thread_pitch > 0.0f && pl_data->spindle.state.on && pl_data->spindle.rpm > 0.0f)
+        return pl_data->spindle.rpm * my_settings.thread_pitch * (1.0f + (float)my_settings.thread_overfeed / 100.0f);
+
+    return my_settings.tool_engagement_feed_rate;
+}
+
+// Plan a move either as a rapid or at the engagement feed rate.
+static bool atc_move (const char *message, coord_data_t *target, plan_line_data_t *pl_data, bool rapid)
+{
+    pl_data->condition.rapid_motion = rapid;
+    pl_data->feed_rate = engagement_feed_rate(pl_data);
+
+    trace_event(message, target, pl_data);
+
+    return atc_line(target->values, pl_data);
+}
+
+static void path_add (coord_data_t *waypoint)
+{
+    coord_data_t *last = sequence.path_length ? &sequence.path[sequence.path_length - 1] : &sequence.target;
+    coord_data_t *origin = sequence.path_length > 1 ? &sequence.path[sequence.path_length - 2] : &sequence.target;
+
+    if(!memcmp(last, waypoint, sizeof(coord_data_t)))
+        return;
+
+    // Two vertical moves in a row, extend the first.
+    if(sequence.path_length && last->x == waypoint->x && last->y == waypoint->y &&
+        origin->x == last->x && origin->y == last->y && (waypoint->z > last->z) == (last->z > origin->z))
+        sequence.path_length--;
+
+    if(sequence.path_length < ATC_PATH_SIZE)
+        memcpy(&sequence.path[sequence.path_length++], waypoint, sizeof(coord_data_t));
+}
+
+// Plan the path from the end of the last move to the destination. Without keep-out boxes the path
+// rises to the travel height, moves in XY and then moves to the destination height.
+// With keep-out boxes the spindle first rises out of any box it is in, then takes the fastest of a
+// straight move, a move through the lowest height at which the XY move is clear with vertical climb
+// and descent, or with the climb or the descent blended into the XY move, that stays out of the boxes.
+static void path_plan (coord_data_t *destination, float z_travel)
+{
+    static const uint8_t n_waypoints[] = { 1, 3, 2, 2 };
+
+    uint_fast8_t route, idx, best = 1;
+    float z, time, best_time = INFINITY;
+    coord_data_t start, climb, travel, waypoint[4][3];
+    plan_line_data_t plan_data;
+
+    sequence.path_length = 0;
+    memcpy(&start, &sequence.target, sizeof(coord_data_t));
+
+    if(geometry.n_keepouts == 0) {
+        memcpy(&travel, destination, sizeof(coord_data_t));
+        travel.z = z_travel;
+        // The climb out of the work is blended into the first move of a planned change when above the racks.
+        if(!(sequence.blend && start.z >= my_settings.tool_z_traverse + sequence.z_offset && path_clear(start.values, travel.values))) {
+            start.z = z_travel;
+            path_add(&start);
+        }
+        sequence.blend = false;
+        path_add(&travel);
+        path_add(destination);
+        return;
+    }
+
+    if((start.z = keepout_exit_z(start.values)) > sequence.target.z)
+        path_add(&start);
+
+    z = min(max(max(start.z, destination->z), keepout_travel_z(start.values, destination->values)), my_settings.tool_z_safe_clearance);
+
+    memcpy(&climb, &start, sizeof(coord_data_t));
+    climb.z = z;
+    memcpy(&travel, destination, sizeof(coord_data_t));
+    travel.z = z;
+
+    // Straight, vertical climb and descent, climb blended into the XY move, descent blended into the XY move.
+    waypoint[0][0] = *destination;
+    waypoint[1][0] = climb;
+    waypoint[1][1] = travel;
+    waypoint[1][2] = *destination;
+    waypoint[2][0] = travel;
+    waypoint[2][1] = *destination;
+    waypoint[3][0] = climb;
+    waypoint[3][1] = *destination;
+
+    plan_data_init(&plan_data);
+    plan_data.condition.rapid_motion = On;
+
+    for(route = 0; route < sizeof(n_waypoints); route++) {
+        // Only the boxes are known below the traverse height, descend vertically there.
+        if((route == 0 || route == 3) && destination->z < geometry.z_traverse && destination->z < start.z)
+            continue;
+        time = estimate_move_time(start.values, waypoint[route][0].values, &plan_data);
+        if(!path_clear(start.values, waypoint[route][0].values))
+            continue;
+        for(idx = 1; idx < n_waypoints[route]; idx++) {
+            if(!path_clear(waypoint[route][idx - 1].values, waypoint[route][idx].values))
+                break;
+            time += estimate_move_time(waypoint[route][idx - 1].values, waypoint[route][idx].values, &plan_data);
+        }
+        if(idx == n_waypoints[route] && time < best_time) {
+            best_time = time;
+            best = route;
+        }
+    }
+
+    // No route is clear if the boxes reach above safe clearance, take the vertical climb and descent anyway.
+    for(idx = 0; idx < n_waypoints[best]; idx++)
+        path_add(&waypoint[best][idx]);
+}
+
+// Plan the moves of a path to the destination, one per call. Returns true when the last move is planned.
+static bool path_move (const char *message, coord_data_t *destination, float z_travel)
+{
+    if(sequence.path_length == 0) {
+        path_plan(destination, z_travel);
+        sequence.path_next = 0;
+        if(sequence.path_length == 0)
+            return true;
+    }
+
+    memcpy(&sequence.target, &sequence.path[sequence.path_next++], sizeof(coord_data_t));
+
+    atc_move(message, &sequence.target, &sequence.plan_data, true);
+
+    if(sequence.path_next < sequence.path_length)
+        return false;
+
+    sequence.path_length = 0;
+
+    return true;
+}
+
+// Update the current tool once the clamping nut is (un)threaded.
+static void sequence_engaged (void)
+{
+    trace_event("Updating current tool", NULL, NULL);
+
+    if(sequence.load)
+        memcpy(&current_tool, next_tool, sizeof(tool_data_t));
+    else {
+        pocket_map_dropped(sequence.drop_pocket, current_tool.tool_id);
+        memset(&current_tool, 0, sizeof(tool_data_t));
+    }
+
+    if(occupancy.valid) {
+        pocket_set_occupied(sequence.load ? sequence.pick_pocket : sequence.drop_pocket, !sequence.load);
+        occupancy_save();
+    }
+}
+
+// Phase handlers plan at most one move per call so the planner can be topped up from the
+// realtime loop without blocking. A handler returns Phase_Wait when it needs the planned motion
+// to complete or the spindle to spin up, this is only done around spindle changes and when reading a sensor.
+
+static phase_result_t phase_coolant_off (void)
+{
+    trace_event("Turning off Coolant", NULL, NULL);
+
+    hal.coolant.set_state((coolant_state_t){0});
+
+    // Stopping is safe at any point, no need to wait for motion to complete.
+    atc_spindle(&sequence.plan_data, (spindle_state_t){0}, 0.0f);
+
+    return Phase_Done;
+}
+
+// Move above the pocket, at the travel height or at the traverse height when planned around keep-out
+// boxes, and lower to the spindle start height.
+static phase_result_t phase_approach (uint16_t pocket_idx, float z_travel)
+{
+    coord_data_t pocket;
+
+    switch(sequence.step) {
+
+        case 0:
+            sequence.z_offset = pocket_z_offset(pocket_idx);
+            memcpy(&pocket, &sequence.target, sizeof(coord_data_t));
+            pocket.x = geometry.x[pocket_idx];
+            pocket.y = geometry.y[pocket_idx];
+            pocket.z = geometry.n_keepouts ? my_settings.tool_z_traverse + sequence.z_offset : z_travel;
+            atc_dust_cover(&pocket, true);
+            if(!path_move("Determine tool position and go there", &pocket, z_travel))
+                return Phase_Continue;
+            break;
+
+        case 1:
+            // Only the descent into the pocket waits for a stopping spindle and the dust cover.
+            if(!((sequence.plan_data.spindle.state.on || atc_elapsed(spindle_off_ms, my_settings.spindown_delay)) && atc_dust_cover_opened()))
+                return Phase_Wait;
+
+            sequence.target.z = my_settings.tool_start_height + sequence.z_offset;
+            atc_move("Going to Spindle Start Height", &sequence.target, &sequence.plan_data, true);
+            break;
+
+        default:
+            return Phase_Done;
+    }
+
+    sequence.step++;
+
+    return Phase_Continue;
+}
+
+// Thread (load) or unthread (unload) the clamping nut in the pocket below the spindle.
+// The spindle is left running, it is stopped or reversed by later phases.
+static phase_result_t phase_engage (void)
+{
+    switch(sequence.step) {
+
+        case 0:
+            if(!atc_synced())
+                return Phase_Wait;
+
+            if(sequence.load)
+                atc_spindle(&sequence.plan_data, (spindle_state_t){ .on = On }, my_settings.tool_pickup_rpm);
+            else
+                atc_spindle(&sequence.plan_data, (spindle_state_t){ .on = On, .ccw = On }, my_settings.tool_dropoff_rpm);
+            break;
+
+        case 1:
+            // Plunge as soon as the spindle is at speed.
+            if(!atc_spindle_at_speed(&sequence.plan_data)) {
+                if(hal.get_elapsed_ticks() - spindle_on_ms < ATC_SPINUP_TIMEOUT)
+                    return Phase_Wait;
+                trace_event("Spindle not at speed", NULL, NULL);
+                sequence.status = Status_GCodeToolError;
+                return Phase_Error;
+            }
+            break;
+
+        case 2:
+            sequence.target.z = my_settings.tool_z_engagement + sequence.z_offset;
+            atc_move("Turning on spindle and moving to engagement height", &sequence.target, &sequence.plan_data, false);
+            break;
+
+        default:
+            if(!my_settings.tool_recognition)
+                sequence_engaged();
+            return Phase_Done;
+    }
+
+    sequence.step++;
+
+    return Phase_Continue;
+}
+
+// Check the clamping nut with the recognition sensor, retry the engagement once on failure.
+// With latched edges Z keeps rising towards the height the next phase moves to and the sensor
+// states at the detect zones are checked once Z has passed them.
+static phase_result_t phase_recognition (void)
+{
+    float z_top = sequence.z_offset + (latch.irq ? max(my_settings.toolrecognition_detect_zone_1, my_settings.toolrecognition_detect_zone_2)
+                                                 : my_settings.toolrecognition_detect_zone_2);
+
+    switch(sequence.step) {
+
+        case 0:
+            recognition_reset();
+            sequence.target.z = z_top;
+            atc_move("Moving through detect zones", &sequence.target, &sequence.plan_data, false);
+            break;
+
+        case 1:
+            if(latch.irq) {
+                float z_exit = geometry.n_keepouts ? my_settings.tool_z_traverse + sequence.z_offset
+                                                   : (sequence.load ? my_settings.tool_z_safe_clearance : sequence.z_travel);
+                if(z_exit > z_top) {
+                    sequence.target.z = z_exit;
+                    atc_move("Raising past detect zones", &sequence.target, &sequence.plan_data, true);
+                }
+            }
+            break;
+
+        case 2:
+            if(!recognition_swept(z_top))
+                return Phase_Wait;
+
+            sequence.recognition = recognition_passed() ? 'Y' : 'N';
+            status_update();
+
+            if(sequence.recognition == 'Y') {
+                sequence_engaged();
+                return Phase_Done;
+            }
+
+            if(sequence.retries++) {
+                sequence.status = Status_GcodeInvalidTarget;
+                return Phase_Error;
+            }
+
+            // IF the nut isn't all the way on lets try again
+            trace_event("Detection Failed Trying again", NULL, NULL);
+            sequence.target.z = my_settings.tool_z_engagement + sequence.z_offset;
+            atc_move("Moving to engagement height", &sequence.target, &sequence.plan_data, false);
+            sequence.step = 0;
+            return Phase_Continue;
+
+        default:
+            return Phase_Done;
+    }
+
+    sequence.step++;
+
+    return Phase_Continue;
+}
+
+// Measure the tool length on the tool setter, or apply the cached length of a tool measured before.
+static phase_result_t phase_measure (void)
+{
+    int32_t contact;
+    coord_data_t setter;
+    atc_tlo_entry_t *cached;
+
+    switch(sequence.step) {
+
+        case 0:
+            // The offset only affects G-code parsed after the tool change, no need to wait for motion to complete.
+            if((cached = tlo_cache_lookup(current_tool.tool_id))) {
+                trace_event("Using cached tool length", NULL, NULL);
+                tlo_apply(cached->contact);
+                return Phase_Done;
+            }
+            break;
+
+        case 1:
+            sequence.target.z = geometry.n_keepouts ? keepout_exit_z(sequence.target.values) : my_settings.tool_z_safe_clearance;
+            atc_move("Raising to clearance height", &sequence.target, &sequence.plan_data, true);
+            break;
+
+        case 2:
+            if(!atc_synced())
+                return Phase_Wait;
+
+            trace_event("Stopping spindle", NULL, NULL);
+            atc_spindle(&sequence.plan_data, (spindle_state_t){0}, 0.0f);
+            break;
+
+        case 3:
+            memcpy(&setter, &sequence.target, sizeof(coord_data_t));
+            setter.x = my_settings.toolsetter_x_pos;
+            setter.y = my_settings.toolsetter_y_pos;
+            setter.z = my_settings.toolsetter_z_start_pos;
+            if(!path_move("Moving to tool setter", &setter, my_settings.tool_z_safe_clearance))
+                return Phase_Continue;
+            break;
+
+        case 4:
+            if(!atc_synced())
+                return Phase_Wait;
+
+            if(!measureTool(&contact)) {
+                sequence.status = Status_GCodeToolError;
+                return Phase_Error;
+            }
+
+            tlo_apply(contact);
+            tlo_cache_store(current_tool.tool_id, contact);
+
+            atc_get_position(&sequence.target);
+            break;
+
+        case 5:
+            sequence.target.z = my_settings.toolsetter_safe_z;
+            atc_move("Raising to Setter Safe Z", &sequence.target, &sequence.plan_data, true);
+            break;
+
+        default:
+            return Phase_Done;
+    }
+
+    sequence.step++;
+
+    return Phase_Continue;
+}
+
+static void manual_prompt (bool unload, bool load)
+{
+    static char msg[96];
+
+    strcpy(msg, "Manual tool change:");
+    if(unload) {
+        strcat(msg, " remove T");
+        strcat(msg, uitoa(current_tool.tool_id));
+    }
+    if(load) {
+        strcat(msg, unload ? ", insert T" : " insert T");
+        strcat(msg, uitoa(next_tool->tool_id));
+    }
+    strcat(msg, " and press cycle start");
+
+    trace_event(msg, NULL, NULL);
+    report_message(msg, Message_Info);
+}
+
+// Park at the manual change position with the spindle stopped and hold for the operator to take out
+// the tool left in the spindle and put in the next tool when it has no pocket, resumed by cycle start.
+static phase_result_t phase_manual (void)
+{
+    coord_data_t park;
+    bool load = sequence.pick_pocket == ATC_NO_POCKET && next_tool->tool_id;
+
+    switch(sequence.step) {
+
+        case 0:
+            trace_event("Stopping spindle", NULL, NULL);
+            atc_spindle(&sequence.plan_data, (spindle_state_t){0}, 0.0f);
+            break;
+
+        case 1:
+            memcpy(&park, &sequence.target, sizeof(coord_data_t));
+            park.x = my_settings.manual_x_pos;
+            park.y = my_settings.manual_y_pos;
+            park.z = my_settings.tool_z_safe_clearance;
+            if(!path_move("Moving to manual change position", &park, my_settings.tool_z_safe_clearance))
+                return Phase_Continue;
+            break;
+
+        case 2:
+            if(!(atc_synced() && atc_elapsed(spindle_off_ms, my_settings.spindown_delay)))
+                return Phase_Wait;
+
+            manual_prompt(current_tool.tool_id != 0, load);
+            system_set_exec_state_flag(EXEC_TOOL_CHANGE);
+            break;
+
+        case 3:
+            // Wait for the hold to be entered, then for cycle start.
+            if(state_get() != STATE_TOOL_CHANGE)
+                return Phase_Wait;
+            break;
+
+        case 4:
+            if(state_get() == STATE_TOOL_CHANGE)
+                return Phase_Wait;
+
+            trace_event("Updating current tool", NULL, NULL);
+
+            // A tool put in by hand sits at a different length in the collet each time, it is always measured.
+            if((sequence.manual_load = load)) {
+                memcpy(&current_tool, next_tool, sizeof(tool_data_t));
+                tlo_cache_invalidate(current_tool.tool_id);
+            } else
+                memset(&current_tool, 0, sizeof(tool_data_t));
+
+            // The operator may have jogged the machine.
+            atc_get_position(&sequence.target);
+            break;
+
+        default:
+            return Phase_Done;
+    }
+
+    sequence.step++;
+
+    return Phase_Continue;
+}
+
+// Retract to safe clearance and stop the spindle once there.
+static phase_result_t phase_return (void)
+{
+    switch(sequence.step) {
+
+        case 0:
+            sequence.target.z = my_settings.tool_z_safe_clearance;
+            atc_move("Raising to clearance height", &sequence.target, &sequence.plan_data, true);
+            break;
+
+        case 1:
+            if(!atc_synced())
+                return Phase_Wait;
+
+            trace_event("Stopping spindle", NULL, NULL);
+            atc_spindle(&sequence.plan_data, (spindle_state_t){0}, 0.0f);
+            break;
+
+        case 2:
+            if(cover_open) {
+                atc_dust_cover(&sequence.target, false);
+                if(my_settings.dust_cover_axis)
+                    atc_move("Closing dust cover", &sequence.target, &sequence.plan_data, true);
+            }
+            break;
+
+        default:
+            return Phase_Done;
+    }
+
+    sequence.step++;
+
+    return Phase_Continue;
+}
+
+// Phases that come after the current tool has been unloaded.
+static atc_phase_t sequence_load_phase (void)
+{
+    if(sequence.pick_pocket != ATC_NO_POCKET) {
+        sequence.load = true;
+        return ATC_LoadApproach;
+    }
+
+    if(next_tool->tool_id) {
+        trace_event("Tool has no pocket. Manual Tool Change", NULL, NULL);
+        return ATC_Manual;
+    }
+
+    return ATC_Return;
+}
+
+// Phases that come after the next tool has been loaded.
+static atc_phase_t sequence_measure_phase (void)
+{
+    return my_settings.tool_setter ? ATC_Measure : ATC_Return;
+}
+
+static atc_phase_t sequence_next_phase (void)
+{
+    atc_phase_t phase = ATC_Idle;
+
+    switch(sequence.phase) {
+
+        case ATC_CoolantOff:
+            if(sequence.drop_pocket != ATC_NO_POCKET)
+                phase = ATC_UnloadApproach;
+            else if(current_tool.tool_id) {
+                trace_event("Tool has no pocket. Manual Tool Change", NULL, NULL);
+                phase = ATC_Manual;
+            } else
+                phase = sequence_load_phase();
+            break;
+
+        case ATC_UnloadApproach:
+            phase = ATC_Unthread;
+            break;
+
+        case ATC_Unthread:
+            phase = my_settings.tool_recognition ? ATC_Recognition : sequence_load_phase();
+            break;
+
+        case ATC_LoadApproach:
+            phase = ATC_Thread;
+            break;
+
+        case ATC_Thread:
+            phase = my_settings.tool_recognition ? ATC_Recognition : sequence_measure_phase();
+            break;
+
+        case ATC_Recognition:
+            phase = sequence.load ? sequence_measure_phase() : sequence_load_phase();
+            break;
+
+        case ATC_Measure:
+            phase = ATC_Return;
+            break;
+
+        // The next tool is loaded from its pocket after a manual unload.
+        case ATC_Manual:
+            if(sequence.pick_pocket != ATC_NO_POCKET)
+                phase = sequence_load_phase();
+            else
+                phase = current_tool.tool_id ? sequence_measure_phase() : ATC_Return;
+            break;
+
+        default:
+            break;
+    }
+
+    return phase;
+}
+
+// Record the phase just entered as the next checkpoint.
+static void sequence_checkpoint (void)
+{
+    memset(&checkpoint_next, 0, sizeof(atc_checkpoint_t));
+    checkpoint_pending = true;
+
+    if((checkpoint_next.phase = sequence.phase) == ATC_Idle)
+        return;
+
+    checkpoint_next.load = sequence.load;
+    checkpoint_next.drop_pocket = sequence.drop_pocket;
+    checkpoint_next.pick_pocket = sequence.pick_pocket;
+    checkpoint_next.unload_tool = sequence.unload_tool;
+    checkpoint_next.load_tool = sequence.load_tool;
+    checkpoint_next.spindle_tool = current_tool.tool_id;
+    checkpoint_next.z_travel = sequence.z_travel;
+}
+
+// Advance the tool change sequence as far as possible without waiting.
+// Moves are planned ahead until the planner is full or a phase has to wait for motion to complete.
+static void sequence_execute (void)
+{
+    phase_result_t result = Phase_Continue;
+
+    while(sequence.phase != ATC_Idle && result == Phase_Continue && atc_can_queue()) {
+
+        switch(sequence.phase) {
+
+            case ATC_CoolantOff:
+                result = phase_coolant_off();
+                break;
+
+            case ATC_UnloadApproach:
+                result = phase_approach(sequence.drop_pocket, my_settings.tool_z_safe_clearance);
+                break;
+
+            case ATC_LoadApproach:
+                result = phase_approach(sequence.pick_pocket, sequence.z_travel);
+                break;
+
+            case ATC_Unthread:
+            case ATC_Thread:
+                result = phase_engage();
+                break;
+
+            case ATC_Recognition:
+                result = phase_recognition();
+                break;
+
+            case ATC_Measure:
+                result = phase_measure();
+                break;
+
+            case ATC_Return:
+                result = phase_return();
+                break;
+
+            case ATC_Manual:
+                result = phase_manual();
+                break;
+
+            default:
+                break;
+        }
+
+        if(result == Phase_Done) {
+            sequence.phase = sequence_next_phase();
+            sequence.step = sequence.retries = 0;
+            trace_phase(sequence.phase);
+            sequence_checkpoint();
+            result = Phase_Continue;
+        } else if(result == Phase_Error) {
+            trace_event("Tool change failed", NULL, NULL);
+            atc_spindle(&sequence.plan_data, (spindle_state_t){0}, 0.0f);
+            sequence.phase = ATC_Idle;
+        }
+    }
+
+    // Start the moves planned by this pass only, a cycle start issued on every pass would end a feed hold.
+    if(sequence.queued) {
+        sequence.queued = false;
+        protocol_auto_cycle_start();
+    }
+}
+
+// Feed hold, safety door and sleep suspend the tool change until the operator resumes it. The hold
+// entered for a manual tool change is the plugin's own and is followed by the Manual phase.
+static inline bool sequence_suspended (sys_state_t state)
+{
+    return (state & (STATE_HOLD|STATE_SAFETY_DOOR|STATE_SLEEP)) || (sys.suspend && state != STATE_TOOL_CHANGE);
+}
+
+// Drive the tool change sequence from the foreground loop.
+static void atc_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(checkpoint_pending && state == STATE_IDLE && plan_get_current_block() == NULL)
+        checkpoint_save();
+
+    // mc_line() may run the realtime loop, do not reenter.
+    if(sequence.phase != ATC_Idle && !sequence.busy && !(state & (STATE_ALARM|STATE_ESTOP)) && !sequence_suspended(state)) {
+        sequence.busy = true;
+        sequence_execute();
+        sequence.busy = false;
+    } else if(sequence.phase == ATC_Idle && my_settings.trace_when_idle && state == STATE_IDLE)
+        trace_drain(4);
+
+    if(timing.active)
+        timing_update();
+}
+
+// Check the pockets of the tool change against the last magazine scan before moving.
+// The current tool is known to be out of the spindle if its pocket holds a nut, the unload is skipped then.
+static status_code_t sequence_check_pockets (void)
+{
+    if(!occupancy.valid)
+        return Status_OK;
+
+    if(sequence.pick_pocket != ATC_NO_POCKET && !pocket_occupied(sequence.pick_pocket)) {
+        trace_event("Pickup pocket is empty", NULL, NULL);
+        return Status_GCodeToolError;
+    }
+
+    if(sequence.drop_pocket != ATC_NO_POCKET && pocket_occupied(sequence.drop_pocket)) {
+
+        if(sequence.drop_pocket != pocket_for_tool(current_tool.tool_id)) {
+            trace_event("Drop-off pocket is occupied", NULL, NULL);
+            return Status_GCodeToolError;
+        }
+
+        trace_event("Tool already in pocket, skipping unload", NULL, NULL);
+        memset(&current_tool, 0, sizeof(tool_data_t));
+        sequence.drop_pocket = ATC_NO_POCKET;
+    }
+
+    return Status_OK;
+}
+
+static status_code_t sequence_start (void)
+{
+    memset(&sequence, 0, sizeof(atc_sequence_t));
+
+    if(lookahead.valid && lookahead.tool_id == next_tool->tool_id && lookahead.spindle_tool == current_tool.tool_id) {
+        sequence.pick_pocket = lookahead.pick_pocket;
+        sequence.drop_pocket = lookahead.drop_pocket;
+        sequence.z_travel = lookahead.z_travel;
+        sequence.blend = true;
+        trace_event("Using lookahead plan", NULL, NULL);
+    } else {
+        sequence.pick_pocket = pocket_for_tool(next_tool->tool_id);
+        sequence.drop_pocket = dropoff_pocket(sequence.pick_pocket);
+        sequence.z_travel = sequence_travel_height(sequence.drop_pocket, sequence.pick_pocket);
+    }
+
+    lookahead.valid = false;
+
+    if((sequence.status = sequence_check_pockets()) != Status_OK)
+        return sequence.status;
+
+    plan_data_init(&sequence.plan_data);
+    atc_get_position(&sequence.target);
+
+    sequence.phase = ATC_CoolantOff;
+    trace_phase(sequence.phase);
+    timing_start();
+    sequence.unload_tool = current_tool.tool_id;
+    sequence.load_tool = next_tool->tool_id;
+    sequence.recognition = '-';
+
+    status_update();
+    if(my_settings.tool_setter)
+        tool_changes++;
+
+    sequence_checkpoint();
+
+    return Status_OK;
+}
+
+// Update the parser state to the tool in the spindle as a completed M6 does, the current tool is
+// set from the tool table.
+static void sequence_set_tool (uint32_t tool_id)
+{
+#if N_TOOLS
+    if(tool_id <= N_TOOLS)
+        gc_state.tool = &tool_table[tool_id];
+#else
+    gc_state.tool->tool_id = tool_id;
+#endif
+    gc_state.tool_pending = gc_state.tool->tool_id;
+    memcpy(&current_tool, gc_state.tool, sizeof(tool_data_t));
+    system_add_rt_report(Report_Tool);
+}
+
+// Phase to resume an interrupted tool change from. Approaches raise Z before moving and can be
+// repeated from anywhere, the nut may be partly (un)threaded when interrupted during engagement
+// or recognition so these are repeated from the approach to the pocket.
+static atc_phase_t sequence_resume_phase (void)
+{
+    switch((atc_phase_t)checkpoint.phase) {
+
+        case ATC_Unthread:
+            return ATC_UnloadApproach;
+
+        case ATC_Thread:
+            return ATC_LoadApproach;
+
+        case ATC_Recognition:
+            return checkpoint.load ? ATC_LoadApproach : ATC_UnloadApproach;
+
+        default:
+            return (atc_phase_t)checkpoint.phase;
+    }
+}
+
+static status_code_t sequence_resume (void)
+{
+    memset(&sequence, 0, sizeof(atc_sequence_t));
+
+    sequence_set_tool(checkpoint.spindle_tool);
+    memset(&resume_tool, 0, sizeof(tool_data_t));
+#if N_TOOLS
+    if(checkpoint.load_tool <= N_TOOLS)
+        memcpy(&resume_tool, &tool_table[checkpoint.load_tool], sizeof(tool_data_t));
+#endif
+    resume_tool.tool_id = checkpoint.load_tool;
+    next_tool = &resume_tool;
+
+    sequence.load = checkpoint.load;
+    sequence.drop_pocket = checkpoint.drop_pocket;
+    sequence.pick_pocket = checkpoint.pick_pocket;
+    sequence.unload_tool = checkpoint.unload_tool;
+    sequence.load_tool = checkpoint.load_tool;
+    sequence.z_travel = checkpoint.z_travel;
+    sequence.manual_load = sequence.load && sequence.pick_pocket == ATC_NO_POCKET;
+    sequence.recognition = '-';
+
+    plan_data_init(&sequence.plan_data);
+    atc_get_position(&sequence.target);
+
+    sequence.phase = sequence_resume_phase();
+    trace_event("Resuming tool change", NULL, NULL);
+    trace_phase(sequence.phase);
+    status_update();
+    sequence_checkpoint();
+
+    return Status_OK;
+}
+
+// Probe the tool setter from the current position, seeking at the setter seek rate and then probing again
+// at the setter feed rate after retreating. Returns the Z contact position in steps.
+// When the expected length of the tool is known the seek is limited to the predictive margin around the
+// expected contact, a seek that makes no contact there continues down to the setter max travel.
+// A tool put in by hand is searched for over the full travel, its last length does not predict the contact.
+static bool measureTool (int32_t *contact)
+{
+    bool found = false;
+    int32_t expected;
+    float seek_end, window;
+    coord_data_t target;
+    plan_line_data_t plan_data;
+
+    plan_data_init(&plan_data);
+    plan_data.feed_rate = my_settings.toolsetter_seek_rate;
+
+    atc_get_position(&target);
+    seek_end = target.z - my_settings.toolsetter_max_travel;
+
+    if(my_settings.toolsetter_margin > 0.0f && !sequence.manual_load && tlo_expected(&current_tool, &expected)) {
+
+        window = (float)expected / settings.axis[Z_AXIS].steps_per_mm + my_settings.toolsetter_margin;
+
+        if(window < target.z && window > seek_end) {
+
+            target.z = window;
+            plan_data.condition.rapid_motion = On;
+            trace_event("Rapid to expected tool length", &target, &plan_data);
+            atc_line(target.values, &plan_data);
+            plan_data.condition.rapid_motion = Off;
+
+            target.z = max(window - my_settings.toolsetter_margin * 2.0f, seek_end);
+            trace_event("Seeking tool setter near expected length", &target, &plan_data);
+
+            // A failed probe stops at the end of the window.
+            if(!(found = atc_probe(&target, &plan_data)))
+                trace_event("No contact near expected length", NULL, NULL);
+        }
+    }
+
+    if(!found) {
+
+        target.z = seek_end;
+        trace_event("Seeking tool setter", &target, &plan_data);
+
+        if(!atc_probe(&target, &plan_data)) {
+            trace_event("Tool setter not found", NULL, NULL);
+            return false;
+        }
+    }
+
+    if(my_settings.toolsetter_retreat) {
+
+        target.z += my_settings.toolsetter_retreat;
+        atc_line(target.values, &plan_data);
+
+        target.z -= my_settings.toolsetter_retreat * 2.0f;
+        plan_data.feed_rate = my_settings.toolsetter_feed_rate;
+
+        trace_event("Probing tool setter", &target, &plan_data);
 
-        if(current_tool.tool_id != next_tool->tool_id) {
-            memcpy(next_tool, &current_tool, sizeof(tool_data_t));
-            system_add_rt_report(Report_Tool);
+        if(!atc_probe(&target, &plan_data)) {
+            trace_event("Tool setter not found", NULL, NULL);
+            return false;
         }
-
-        gc_state.tool_pending = gc_state.tool->tool_id;
-        next_tool = NULL;
     }
 
-    driver_reset();
+    *contact = sys.probe_position[Z_AXIS];
+
+    return true;
 }
 
-// Set next and/or current tool. Called by gcode.c on on a Tn or M61 command (via HAL).
-static void tool_select (tool_data_t *tool, bool next)
-{
-    next_tool = tool;
-    if(!next)
-        memcpy(&current_tool, tool, sizeof(tool_data_t));
+// Read the recognition sensor, true if the beam is blocked.
+static bool laserBlocked() {
+
+    return latch.port != ATC_NO_PORT && hal.port.wait_on_input(Port_Digital, latch.port, WaitMode_Immediate, 0.0f) == 1;
 }
 
-static status_code_t spindle(bool load) {
+// Check that the machine is homed and the magazine geometry is valid before moving.
+// Building with DEBUG defined skips the homing check while developing.
+static status_code_t sequence_ready (void)
+{
+    sequence.status = Status_OK;
 
-    debug_output(load ? "Loading" : "Unloading", NULL, NULL);
-    coord_data_t target = {0}, current_pos;
-    plan_line_data_t plan_data;
+#ifndef DEBUG
+    uint8_t homed_req =  (X_AXIS_BIT|Y_AXIS_BIT|Z_AXIS_BIT);
+
+    if((sys.homed.mask & homed_req) != homed_req)
+        return sequence.status = Status_HomingRequired;
+#endif
+
+    if(geometry.status != Status_OK) {
+        report_message(geometry.error, Message_Warning);
+        sequence.status = geometry.status;
+    }
+
+    return sequence.status;
+}
+
+// Start a tool change sequence. Called by gcode.c on a M6 command (via HAL).
+// The sequence is driven from the realtime loop, the parser is held until the moves
+// after the last sensor check are planned so status reports, feed hold and reset stay responsive.
+static status_code_t tool_change (parser_state_t *parser_state)
+{
+    if(next_tool == NULL)
+        return Status_GCodeToolError;
 
-    if(current_tool.tool_id == 0 && !load) {
-        debug_output("No tool to unload", NULL, NULL);
+    if(current_tool.tool_id == next_tool->tool_id)
         return Status_OK;
+
+    if(sequence_ready() != Status_OK)
+        return sequence.status;
+
+    if(sequence_start() != Status_OK)
+        return sequence.status;
+
+    while(sequence.phase != ATC_Idle) {
+        // Aborted by a reset, reset() has restored the tool state.
+        if(!protocol_execute_realtime())
+            return Status_OK;
     }
 
-    if(next_tool->tool_id > my_settings.number_of_pockets) {
-        debug_output("Tool number is larger than pocket. Manual Tool Change", NULL, NULL);
-        if(load) {
-            manualToolLoad();
-        } else {
-            manualToolUnLoad();
+    return sequence.status;
+}
+
+// List the pocket assignments, or assign a tool to a pocket with $ATCMAP=<pocket>,<tool>.
+// Tool 0 clears the pocket, a tool already assigned to another pocket is moved.
+static status_code_t map_cmd (sys_state_t state, char *args)
+{
+    uint_fast16_t idx;
+
+    if(args == NULL) {
+        for(idx = 0; idx < geometry.n_pockets; idx++) {
+            hal.stream.write("[ATCMAP:");
+            hal.stream.write(uitoa(idx + 1));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(pocket_map.tool_id[idx]));
+            hal.stream.write("]" ASCII_EOL);
         }
         return Status_OK;
     }
 
-    memset(&target, 0, sizeof(coord_data_t)); // Zero plan_data struct
-    plan_data_init(&plan_data);
+    if(state != STATE_IDLE)
+        return Status_IdleError;
 
-    // Lets stop the spindle and set the feed rate for all moves.
-    plan_data.spindle.hal->set_state(plan_data.spindle.hal, (spindle_state_t){0}, 0.0f);
-    plan_data.feed_rate = my_settings.tool_engagement_feed_rate;
-    plan_data.condition.rapid_motion = Off;
+    float pocket, tool;
+    uint_fast8_t counter = 0;
 
+    if(!read_float(args, &counter, &pocket) || args[counter++] != ',' || !read_float(args, &counter, &tool))
+        return Status_BadNumberFormat;
 
-    system_convert_array_steps_to_mpos(current_pos.values, sys.position);
-    debug_output("Getting Current POS", &current_pos, &plan_data);
+    if(pocket < 1.0f || pocket > (float)geometry.n_pockets || tool < 0.0f)
+        return Status_SettingValueOutOfRange;
 
-    // Raise Z to safe clearance 
-    target = current_pos;
-    target.z = my_settings.tool_z_safe_clearance;
-    debug_output("Raising Z to Clearance Height", NULL, &plan_data);
-    mc_line(target.values, &plan_data);
+    if((idx = pocket_for_tool((uint32_t)tool)) != ATC_NO_POCKET)
+        pocket_map.tool_id[idx] = 0;
 
-    // Get X,Y for current tool and move to that position
-    target = get_tool_location((load?*next_tool:current_tool));
-    target.z = my_settings.tool_z_safe_clearance;
-    debug_output("Determine tool position and go there", &target, &plan_data);
-    mc_line(target.values, &plan_data);
+    pocket_map.tool_id[(uint16_t)pocket - 1] = (uint32_t)tool;
+    pocket_map_index();
+    pocket_map_save();
 
-    target.z = my_settings.tool_start_height;
-    debug_output("Going to Spindle Start Height", &target, &plan_data);
-    mc_line(target.values, &plan_data);
+    return Status_OK;
+}
 
-    // Turn on the spindle CCW
-    if(load) {
-        plan_data.spindle.hal->set_state(plan_data.spindle.hal, (spindle_state_t){ .on = On }, my_settings.tool_pickup_rpm);
-    } else {
-        plan_data.spindle.hal->set_state(plan_data.spindle.hal, (spindle_state_t){ .on = On, .ccw = On }, my_settings.tool_dropoff_rpm);
-    }
-
-    // move to engagement height
-    target.z = my_settings.tool_z_engagement;
-    debug_output("Turning on spindle and moving to engagement height", &target, &plan_data);
-    mc_line(target.values, &plan_data);
-
-    // Are we doing tool recognition
-    if(my_settings.tool_recognition) {
-        debug_output("Tool Recognition Enabled", NULL, NULL);
-        // Move spindle to zone 2
-        target.z = my_settings.toolrecognition_detect_zone_2;
-        debug_output("Moving to zone 2", &target, &plan_data);
-        mc_line(target.values, &plan_data);
-        // Wait for spindle to be in the correct location
-        protocol_buffer_synchronize();
-        // IF the nut isn't all the way on lets try again
-        if(laserBlocked()) {
-            target.z = my_settings.tool_z_engagement;
-            debug_output("Detection Failed Trying again", NULL, NULL);
-
-            mc_line(target.values, &plan_data);
-            target.z = my_settings.toolrecognition_detect_zone_1;
-            mc_line(target.values, &plan_data);
-            protocol_buffer_synchronize();
-        }
-        
-        if(laserBlocked()) {
-            // TODO: Need to error out.
-            return Status_GcodeInvalidTarget;
-        }
-
-        // Bring Spindle up and Turn off spindle
-        
-        target.z = my_settings.tool_z_safe_clearance;
-        plan_data.spindle.hal->set_state(plan_data.spindle.hal, (spindle_state_t)(spindle_state_t){ .on = Off }, 0.0f);
-        debug_output("Stopping spindle and raising to clearance height", &target, &plan_data);
-        mc_line(target.values, &plan_data); 
+#if SDCARD_ENABLE
 
+// Working storage for a job scan, allocated for the duration of the scan only.
+typedef struct {
+    uint16_t weight[ATC_SCAN_MAX_TOOLS][ATC_SCAN_MAX_TOOLS];   // number of changes between two tools, either direction
+    uint8_t  occupant[ATC_MAX_POCKETS];                         // tool index + 1 in each pocket, 0 if none
+    uint16_t pocket[ATC_SCAN_MAX_TOOLS];
+    uint8_t  chain[ATC_SCAN_MAX_TOOLS];
+} job_scan_t;
+
+// Streaming G-code tokenizer state, only T and M words are of interest.
+typedef struct {
+    char     letter;                // letter of the current word, 0 if none
+    bool     fraction;
+    bool     comment;               // inside a (...) comment
+    bool     skip_line;             // after a ; comment
+    bool     m6;
+    uint32_t value;
+    uint32_t tool;                  // last T word seen
+    uint32_t spindle;               // tool in the spindle after the last M6
+} job_parser_t;
+
+static job_scan_t *scan;
+
+// Get the index of a tool in the job, adding it if new. Returns -1 if there are too many tools.
+static int_fast8_t job_tool (uint32_t tool_id)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < job_plan.n_tools; idx++) {
+        if(job_plan.tool_id[idx] == tool_id)
+            return idx;
     }
-    debug_output("Updating current tool", NULL, NULL);
-    
-    if(load) {
-        memset(&current_tool, 0, sizeof(tool_data_t));
-    } else {
-        memcpy(&current_tool, next_tool, sizeof(tool_data_t));
+
+    if(job_plan.n_tools == ATC_SCAN_MAX_TOOLS)
+        return -1;
+
+    job_plan.tool_id[job_plan.n_tools] = tool_id;
+
+    return job_plan.n_tools++;
+}
+
+static bool job_change (uint32_t from, uint32_t to)
+{
+    int_fast8_t a = -1, b = -1;
+
+    job_plan.changes++;
+
+    if((to && (b = job_tool(to)) < 0) || (from && (a = job_tool(from)) < 0))
+        return false;
+
+    // Travel from and to the work area does not depend on the layout.
+    if(a >= 0 && b >= 0 && a != b) {
+        if(scan->weight[a][b] < UINT16_MAX) {
+            scan->weight[a][b]++;
+            scan->weight[b][a]++;
+        }
     }
 
-    protocol_buffer_synchronize();
+    return true;
+}
+
+static void job_end_word (job_parser_t *parser)
+{
+    if(parser->letter == 'T')
+        parser->tool = parser->value;
+    else if(parser->letter == 'M' && parser->value == 6 && !parser->fraction)
+        parser->m6 = true;
+
+    parser->letter = '\0';
+    parser->value = 0;
+    parser->fraction = false;
+}
 
-    return Status_OK;
+static bool job_parse (job_parser_t *parser, const char *buf, size_t len)
+{
+    char c;
+
+    while(len--) {
+
+        c = *buf++;
+
+        if(c == '\n' || c == '\r') {
+            job_end_word(parser);
+            if(parser->m6) {
+                if(parser->tool != parser->spindle && !job_change(parser->spindle, parser->tool))
+                    return false;
+                parser->spindle = parser->tool;
+                parser->m6 = false;
+            }
+            parser->comment = parser->skip_line = false;
+        } else if(parser->skip_line)
+            continue;
+        else if(parser->comment)
+            parser->comment = c != ')';
+        else if(c == '(' || c == ';') {
+            job_end_word(parser);
+            parser->comment = c == '(';
+            parser->skip_line = c == ';';
+        } else if(isalpha((unsigned char)c)) {
+            job_end_word(parser);
+            parser->letter = toupper((unsigned char)c);
+        } else if(parser->letter && isdigit((unsigned char)c)) {
+            if(!parser->fraction)
+                parser->value = parser->value * 10 + (c - '0');
+        } else if(parser->letter && c == '.')
+            parser->fraction = true;
+        else if(c != ' ' && c != '\t')
+            job_end_word(parser);
+    }
+
+    return true;
+}
+
+// Layout cost of a single tool.
+static float job_tool_cost (uint16_t *pocket, uint_fast8_t tool)
+{
+    uint_fast8_t idx;
+    float cost = 0.0f;
+
+    for(idx = 0; idx < job_plan.n_tools; idx++) {
+        if(scan->weight[tool][idx])
+            cost += scan->weight[tool][idx] * pocket_distance(pocket[tool], pocket[idx]);
+    }
 
+    return cost;
 }
 
-static void manualToolLoad() {
+static float job_cost (uint16_t *pocket)
+{
+    uint_fast8_t idx;
+    float cost = 0.0f;
+
+    for(idx = 0; idx < job_plan.n_tools; idx++)
+        cost += job_tool_cost(pocket, idx);
 
+    return cost / 2.0f;
 }
 
-static void manualToolUnLoad() {
+// Improve a layout by moving single tools to other pockets, swapping with the occupant if any,
+// until no move reduces the total travel.
+static float job_improve (uint16_t *pocket, uint16_t n_pockets)
+{
+    bool improved = true;
+    uint_fast8_t tool, other, passes = 0;
+    uint_fast16_t target, from;
+    float before;
+
+    memset(scan->occupant, 0, sizeof(scan->occupant));
+    for(tool = 0; tool < job_plan.n_tools; tool++)
+        scan->occupant[pocket[tool]] = tool + 1;
+
+    while(improved && passes++ < 50) {
+        improved = false;
+        for(tool = 0; tool < job_plan.n_tools; tool++) {
+            for(target = 0; target < n_pockets; target++) {
+
+                if((from = pocket[tool]) == target)
+                    continue;
+
+                other = scan->occupant[target];
+                before = job_tool_cost(pocket, tool) + (other ? job_tool_cost(pocket, other - 1) : 0.0f);
+
+                pocket[tool] = target;
+                if(other)
+                    pocket[other - 1] = from;
+
+                if(job_tool_cost(pocket, tool) + (other ? job_tool_cost(pocket, other - 1) : 0.0f) < before - 0.001f) {
+                    scan->occupant[target] = tool + 1;
+                    scan->occupant[from] = other;
+                    improved = true;
+                } else {
+                    pocket[tool] = from;
+                    if(other)
+                        pocket[other - 1] = target;
+                }
+            }
+        }
+    }
 
+    return job_cost(pocket);
 }
 
-static void measureTool() {
-    coord_data_t current_pos;
+// Place the tools side by side, most frequent changes first, growing a chain at the end
+// with the strongest connection to the next tool.
+static void job_chain_layout (uint16_t *pocket)
+{
+    bool placed[ATC_SCAN_MAX_TOOLS] = {0};
+    uint_fast8_t idx, tool, head, tail, length = 1, best = 0, other = 0;
+    int_fast32_t weight, best_weight;
+
+    // Start with the pair of tools changed between most often.
+    for(idx = 1; idx < job_plan.n_tools; idx++) {
+        for(tool = 0; tool < idx; tool++) {
+            if(scan->weight[idx][tool] > scan->weight[best][other]) {
+                best = idx;
+                other = tool;
+            }
+        }
+    }
+
+    scan->chain[0] = best;
+    placed[best] = true;
+
+    if(other != best) {
+        scan->chain[length++] = other;
+        placed[other] = true;
+    }
 
-    system_convert_array_steps_to_mpos(current_pos.values, sys.position);
+    while(length < job_plan.n_tools) {
+        best_weight = -1;
+        head = scan->chain[0];
+        tail = scan->chain[length - 1];
+        for(tool = 0; tool < job_plan.n_tools; tool++) {
+            if(!placed[tool] && (weight = max(scan->weight[tool][head], scan->weight[tool][tail])) > best_weight) {
+                best_weight = weight;
+                best = tool;
+            }
+        }
+        if(scan->weight[best][head] > scan->weight[best][tail]) {
+            memmove(&scan->chain[1], &scan->chain[0], length);
+            scan->chain[0] = best;
+        } else
+            scan->chain[length] = best;
+        placed[best] = true;
+        length++;
+    }
 
+    for(idx = 0; idx < job_plan.n_tools; idx++)
+        pocket[scan->chain[idx]] = idx;
 }
 
-static bool laserBlocked() {
+// Compute the travel of the job with the current pocket assignments and a proposed assignment
+// that minimizes it. Starts from both the current layout and a chain layout, keeping the best.
+// Both totals cover all changes, tools without a pocket are counted in the first unused ones.
+static void job_optimize (uint16_t n_pockets)
+{
+    bool used[ATC_MAX_POCKETS] = {0};
+    uint_fast8_t idx, other;
+    uint_fast16_t free_pocket = 0;
+    float cost;
 
-    return false;
+    job_plan.manual_changes = 0;
+
+    for(idx = 0; idx < job_plan.n_tools; idx++) {
+        if((scan->pocket[idx] = pocket_for_tool(job_plan.tool_id[idx])) != ATC_NO_POCKET)
+            used[scan->pocket[idx]] = true;
+    }
+
+    for(idx = 0; idx < job_plan.n_tools; idx++) {
+        for(other = idx + 1; other < job_plan.n_tools; other++) {
+            if(scan->pocket[idx] == ATC_NO_POCKET || scan->pocket[other] == ATC_NO_POCKET)
+                job_plan.manual_changes += scan->weight[idx][other];
+        }
+    }
+
+    // Seed with the current layout, tools without a pocket go in the first unused ones.
+    for(idx = 0; idx < job_plan.n_tools; idx++) {
+        if(scan->pocket[idx] == ATC_NO_POCKET) {
+            while(used[free_pocket])
+                free_pocket++;
+            used[free_pocket] = true;
+            scan->pocket[idx] = free_pocket;
+        }
+    }
+
+    job_plan.current_distance = job_cost(scan->pocket);
+    job_plan.planned_distance = job_improve(scan->pocket, n_pockets);
+    memcpy(job_plan.pocket, scan->pocket, sizeof(job_plan.pocket));
+
+    job_chain_layout(scan->pocket);
+
+    if((cost = job_improve(scan->pocket, n_pockets)) < job_plan.planned_distance) {
+        job_plan.planned_distance = cost;
+        memcpy(job_plan.pocket, scan->pocket, sizeof(job_plan.pocket));
+    }
 }
 
-// Start a tool change sequence. Called by gcode.c on a M6 command (via HAL).
-static status_code_t tool_change (parser_state_t *parser_state)
+static void job_plan_report (void)
 {
-    if(next_tool == NULL)
-        return Status_GCodeToolError;
+    uint_fast8_t idx;
+
+    hal.stream.write("[ATCJOB:");
+    hal.stream.write(uitoa(job_plan.changes));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job_plan.n_tools));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(job_plan.current_distance, 0));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(job_plan.planned_distance, 0));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(job_plan.manual_changes));
+    hal.stream.write("]" ASCII_EOL);
+
+    for(idx = 0; idx < job_plan.n_tools; idx++) {
+        hal.stream.write("[ATCJOB:T");
+        hal.stream.write(uitoa(job_plan.tool_id[idx]));
+        hal.stream.write(",P");
+        hal.stream.write(uitoa(job_plan.pocket[idx] + 1));
+        hal.stream.write("]" ASCII_EOL);
+    }
+}
 
-    if(current_tool.tool_id == next_tool->tool_id)
+// Scan a job file for tool changes and propose pocket assignments that minimize the travel
+// between pockets over the whole job. The file is streamed in small chunks, memory use is
+// bounded by the number of distinct tools.
+// Reports [ATCJOB:<changes>,<tools>,<current mm>,<proposed mm>,<manual changes>] followed by
+// the proposed pocket of each tool, use $ATCAPPLY to store it in the pocket map.
+static status_code_t job_scan_cmd (sys_state_t state, char *args)
+{
+    char buf[128];
+    size_t len;
+    vfs_file_t *file;
+    job_parser_t parser = {0};
+    status_code_t status = Status_OK;
+    uint16_t n_pockets = geometry.n_pockets;
+
+    if(args == NULL) {
+        if(!job_plan.valid)
+            return Status_InvalidStatement;
+        job_plan_report();
         return Status_OK;
+    }
 
-#ifndef DEBUG
-    uint8_t homed_req =  (X_AXIS_BIT|Y_AXIS_BIT|Z_AXIS_BIT);
+    if(state != STATE_IDLE)
+        return Status_IdleError;
+
+    if((file = vfs_open(args, "r")) == NULL)
+        return Status_SDFailedOpenFile;
+
+    if((scan = calloc(1, sizeof(job_scan_t))) == NULL) {
+        vfs_close(file);
+        return Status_FileReadError;
+    }
+
+    memset(&job_plan, 0, sizeof(atc_job_plan_t));
+    parser.tool = parser.spindle = current_tool.tool_id;
+
+    while((len = vfs_read(buf, 1, sizeof(buf), file)) > 0) {
+        if(!job_parse(&parser, buf, len)) {
+            status = Status_GCodeToolError;     // Too many tools
+            break;
+        }
+    }
+
+    vfs_close(file);
+
+    if(status == Status_OK && job_parse(&parser, "\n", 1)) {
+        if(job_plan.n_tools > n_pockets)
+            status = Status_GCodeToolError;
+        else {
+            job_optimize(n_pockets);
+            job_plan.valid = true;
+            job_plan_report();
+        }
+    }
+
+    free(scan);
+    scan = NULL;
+
+    return status;
+}
+
+// Store the pocket assignments proposed by the last job scan in the pocket map.
+// The tools must be placed in the magazine accordingly, tools displaced from their pocket are unassigned.
+static status_code_t job_apply_cmd (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+    uint16_t pocket;
+
+    if(state != STATE_IDLE)
+        return Status_IdleError;
+
+    if(!job_plan.valid)
+        return Status_InvalidStatement;
+
+    for(idx = 0; idx < job_plan.n_tools; idx++) {
+        if((pocket = pocket_for_tool(job_plan.tool_id[idx])) != ATC_NO_POCKET)
+            pocket_map.tool_id[pocket] = 0;
+    }
+
+    for(idx = 0; idx < job_plan.n_tools; idx++)
+        pocket_map.tool_id[job_plan.pocket[idx]] = job_plan.tool_id[idx];
+
+    pocket_map_index();
+    pocket_map_save();
+
+    job_plan.valid = false;
+
+    return Status_OK;
+}
 
-    if((sys.homed.mask & homed_req) != homed_req)
-        return Status_HomingRequired;
 #endif
 
-    coord_data_t previous;
+static void stats_report (const char *name, atc_phase_stats_t *entry)
+{
+    uint_fast8_t idx;
+
+    hal.stream.write("[ATCSTATS:");
+    hal.stream.write(name);
+    hal.stream.write(",");
+    hal.stream.write(uitoa(entry->count));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(entry->min, 0));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(entry->count ? entry->sum / (float)entry->count : 0.0f, 0));
+    hal.stream.write(",");
+    hal.stream.write(ftoa(entry->max, 0));
+
+    for(idx = 0; idx < ATC_STATS_BUCKETS; idx++) {
+        hal.stream.write(idx ? "," : "|");
+        hal.stream.write(uitoa(entry->histogram[idx]));
+    }
+
+    hal.stream.write("]" ASCII_EOL);
+}
+
+// Output timing statistics for each phase and the complete tool change as
+// [ATCSTATS:<phase>,<count>,<min ms>,<mean ms>,<max ms>|<histogram>], $ATCSTATS=0 clears them.
+// Histogram buckets are < 100, 250, 500, 1000, 2000, 5000, 10000 and >= 10000 ms.
+static status_code_t stats_cmd (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+
+    if(args) {
+        if(strcmp(args, "0"))
+            return Status_InvalidStatement;
+        memset(&stats, 0, sizeof(atc_stats_t));
+        if(my_settings.persist_stats)
+            nvs_block_save(stats_address, &stats, sizeof(atc_stats_t), ATC_STATS_VERSION);
+        return Status_OK;
+    }
 
-    // Save current position
-    system_convert_array_steps_to_mpos(previous.values, sys.position);
+    for(idx = ATC_CoolantOff; idx < ATC_NumPhases; idx++)
+        stats_report(phase_name[idx], &stats.phase[idx]);
 
-    debug_output("Turning off Coolant", NULL, NULL);
+    stats_report("Cycle", &stats.phase[ATC_STATS_CYCLE]);
 
-    // Stop spindle and coolant
-    hal.coolant.set_state((coolant_state_t){0});
-    
-    debug_output("Check if we need to unload tool", NULL, NULL);
-    spindle(false);
-    debug_output("Check if we need to load a tool", NULL, NULL);
-    spindle(true);
-    debug_output("Check if we need to measure a tool", NULL, NULL);
-    measureTool();
-    
+    return Status_OK;
+}
+
+// Move to the destination on the path a tool change takes, clear of the keep-out boxes, and wait for it
+// to complete. Returns false if aborted.
+static bool scan_move (const char *message, coord_data_t *destination, float z_travel)
+{
+    while(!path_move(message, destination, z_travel));
+
+    return protocol_buffer_synchronize();
+}
+
+// Pass the spindle along a row of pockets at the traverse height of the rack, from pocket first to last,
+// and record which pockets are occupied. The spindle comes from the pocket the previous pass ended at,
+// if any. Returns false if aborted.
+static bool scan_row (atc_rack_t *rack, uint16_t previous, uint16_t first, uint16_t last)
+{
+    bool ok, blocked;
+    uint_fast16_t pocket, idx;
+    uint8_t axis = rack->axis;
+    float direction = rack->direction, half_pocket = rack->pocket_offset / 2.0f;
+    int32_t center;
+    coord_data_t start, end;
+
+    latch.axis = axis;
+    latch.count = 0;
+
+    start = get_pocket_location(first);
+    start.values[axis] -= direction * half_pocket;
+    start.z = my_settings.tool_z_traverse + rack->z_offset;
+
+    if((ok = scan_move("Moving to scan start", &start, sequence_travel_height(previous, first)))) {
+
+        latch.initial = laserBlocked();
+        latch.armed = true;
+
+        end = get_pocket_location(last);
+        sequence.target.values[axis] = end.values[axis] + direction * half_pocket;
+        atc_move("Scanning row", &sequence.target, &sequence.plan_data, false);
+
+        ok = protocol_buffer_synchronize();
+        latch.armed = false;
+    }
+
+    if(ok) {
+        // The sensor state at each pocket center is the state after the last edge passed before reaching it.
+        for(pocket = first; pocket <= last; pocket++) {
+            center = lroundf(get_pocket_location(pocket).values[axis] * settings.axis[axis].steps_per_mm);
+            blocked = latch.initial;
+            for(idx = 0; idx < latch.count && (direction > 0.0f ? latch.edge[idx].position <= center : latch.edge[idx].position >= center); idx++)
+                blocked = latch.edge[idx].blocked;
+            pocket_set_occupied(pocket, blocked);
+
+            hal.stream.write("[ATCSCAN:");
+            hal.stream.write(uitoa(pocket + 1));
+            hal.stream.write(blocked ? ",1," : ",0,");
+            hal.stream.write(uitoa(pocket_map.tool_id[pocket]));
+            hal.stream.write("]" ASCII_EOL);
+        }
+    }
+
+    return ok;
+}
+
+// Pass the spindle along each row of the magazine at the traverse height with the recognition sensor latching
+// the position of each clamping nut, and record which pockets are occupied. $ATCSCAN=0 clears the
+// result so tool changes are no longer checked against it.
+// Outputs [ATCSCAN:<pocket>,<occupied>,<tool>] for each pocket, tool is the tool assigned to the pocket.
+static status_code_t scan_cmd (sys_state_t state, char *args)
+{
+    if(args) {
+        if(strcmp(args, "0"))
+            return Status_InvalidStatement;
+        occupancy.valid = false;
+        occupancy_save();
+        return Status_OK;
+    }
+
+    if(state != STATE_IDLE)
+        return Status_IdleError;
+
+    if(sequence_ready() != Status_OK)
+        return sequence.status;
+
+    if(!latch.irq || geometry.n_pockets == 0)
+        return Status_GcodeUnsupportedCommand;
+
+    bool ok = true;
+    uint_fast8_t idx;
+    uint_fast16_t first, last, previous = ATC_NO_POCKET, max_columns = 0;
+    atc_rack_t *rack;
+    coord_data_t target;
+
+    for(idx = 0; idx < geometry.n_racks; idx++)
+        max_columns = max(max_columns, geometry.rack[idx].columns);
+
+    // Room for a blocked and a cleared edge for each pocket of a row plus a nut at each end of the pass.
+    if((latch.edge = calloc(max_columns * 2 + 2, sizeof(atc_edge_t))) == NULL) {
+        recognition_reset();
+        return Status_GcodeUnsupportedCommand;
+    }
+
+    latch.size = max_columns * 2 + 2;
+
+    // Moves are planned as by a tool change, from the current position.
+    plan_data_init(&sequence.plan_data);
+    system_convert_array_steps_to_mpos(sequence.target.values, sys.position);
+    sequence.path_length = 0;
+    sequence.blend = false;
+
+    for(idx = 0; ok && idx < geometry.n_racks; idx++) {
+
+        rack = &geometry.rack[idx];
+
+        for(first = rack->first; ok && first < rack->first + rack->pockets; first += rack->columns) {
+            last = min(first + rack->columns, rack->first + rack->pockets) - 1;
+            ok = scan_row(rack, previous, first, last);
+            previous = last;
+        }
+    }
+
+    if(ok) {
+
+        occupancy.valid = true;
+        occupancy_save();
+
+        memcpy(&target, &sequence.target, sizeof(coord_data_t));
+        target.z = my_settings.tool_z_safe_clearance;
+        ok = scan_move("Rising to safe clearance", &target, my_settings.tool_z_safe_clearance);
+    }
+
+    sequence.queued = false;
+
+    free(latch.edge);
+    recognition_reset();
+
+    // When aborted by a reset the occupancy is left unchanged.
+    return ok ? Status_OK : Status_Reset;
+}
+
+// List the cached tool lengths as [ATCTLO:<tool>,<Z contact mm>,<age>], the age is the number of tool changes
+// since the tool was measured. $ATCTLO=<tool> forces a tool to be measured on its next load, $ATCTLO=0 clears the cache.
+static status_code_t tlo_cmd (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+
+    if(args == NULL) {
+        for(idx = 0; idx < ATC_TLO_CACHE_SIZE; idx++) {
+            if(tlo_cache.entry[idx].valid) {
+                hal.stream.write("[ATCTLO:");
+                hal.stream.write(uitoa(tlo_cache.entry[idx].tool_id));
+                hal.stream.write(",");
+                hal.stream.write(ftoa((float)tlo_cache.entry[idx].contact / settings.axis[Z_AXIS].steps_per_mm, 3));
+                hal.stream.write(",");
+                hal.stream.write(uitoa(tlo_cache_age(&tlo_cache.entry[idx])));
+                hal.stream.write("]" ASCII_EOL);
+            }
+        }
+        return Status_OK;
+    }
+
+    float tool;
+    uint_fast8_t counter = 0;
+
+    if(!read_float(args, &counter, &tool) || tool < 0.0f)
+        return Status_BadNumberFormat;
+
+    tlo_cache_invalidate((uint32_t)tool);
+
+    return Status_OK;
+}
+
+// Resume a tool change interrupted by a reset or a failure from the last checkpoint, $ATCRESUME=0 discards the checkpoint.
+static status_code_t resume_cmd (sys_state_t state, char *args)
+{
+    if(args) {
+        if(strcmp(args, "0"))
+            return Status_InvalidStatement;
+
+        memset(&checkpoint_next, 0, sizeof(atc_checkpoint_t));
+        checkpoint_save();
+
+        return Status_OK;
+    }
+
+    if(checkpoint.phase == ATC_Idle) {
+        report_message("No tool change to resume", Message_Info);
+        return Status_OK;
+    }
+
+    if(state != STATE_IDLE || sequence.phase != ATC_Idle)
+        return Status_IdleError;
+
+    if(sequence_ready() != Status_OK || sequence_resume() != Status_OK)
+        return sequence.status;
+
+    while(sequence.phase != ATC_Idle) {
+        if(!protocol_execute_realtime())
+            return Status_OK;
+    }
+
+    next_tool = NULL;
+
+    if(sequence.status == Status_OK)
+        sequence_set_tool(current_tool.tool_id);
+
+    return sequence.status;
+}
+
+// Output all recorded trace events.
+static status_code_t trace_cmd (sys_state_t state, char *args)
+{
+    trace_drain(ATC_TRACE_SIZE);
 
     return Status_OK;
 }
 
+static const sys_command_t atc_command_list[] = {
+    {"ATCTRACE", trace_cmd, { .noargs = On, .allow_blocking = On }, { .str = "output tool change trace" } },
+    {"ATCSTATS", stats_cmd, { .allow_blocking = On }, { .str = "output tool change timing statistics, $ATCSTATS=0 clears them" } },
+    {"ATCTLO", tlo_cmd, { .allow_blocking = On }, { .str = "list cached tool lengths, $ATCTLO=<tool> forces a tool to be measured again, $ATCTLO=0 clears them" } },
+    {"ATCSCAN", scan_cmd, {0}, { .str = "scan magazine for occupied pockets, $ATCSCAN=0 clears the result" } },
+    {"ATCRESUME", resume_cmd, {0}, { .str = "resume an interrupted tool change, $ATCRESUME=0 discards it" } },
+    {"ATCMAP", map_cmd, {0}, { .str = "list pocket assignments or assign tool to pocket: $ATCMAP=<pocket>,<tool>" } },
+#if SDCARD_ENABLE
+    {"ATC", job_scan_cmd, {0}, { .str = "scan job for tool changes and propose pocket assignments: $ATC=<filename>" } },
+    {"ATCAPPLY", job_apply_cmd, { .noargs = On }, { .str = "store pocket assignments proposed by $ATC" } }
+#endif
+};
+
+static sys_commands_t atc_commands = {
+    .n_commands = sizeof(atc_command_list) / sizeof(sys_command_t),
+    .commands = atc_command_list
+};
+
+static sys_commands_t *atc_get_commands (void)
+{
+    return &atc_commands;
+}
+
 static void report_options (bool newopt)
 {
     on_report_options(newopt);
 
     if(!newopt) {
         hal.stream.write("[PLUGIN: RapidChange ATC v0.01]" ASCII_EOL);
+        if(stats.phase[ATC_STATS_CYCLE].count) {
+            hal.stream.write("[ATC CYCLE:");
+            hal.stream.write(uitoa(stats.phase[ATC_STATS_CYCLE].count));
+            hal.stream.write(",");
+            hal.stream.write(ftoa(stats.phase[ATC_STATS_CYCLE].sum / (float)stats.phase[ATC_STATS_CYCLE].count, 0));
+            hal.stream.write("]" ASCII_EOL);
+        }
+        if(checkpoint.phase != ATC_Idle) {
+            hal.stream.write("[ATC RESUME:");
+            hal.stream.write(phase_name[checkpoint.phase]);
+            hal.stream.write(",");
+            hal.stream.write(uitoa(checkpoint.unload_tool));
+            hal.stream.write(",");
+            hal.stream.write(uitoa(checkpoint.load_tool));
+            hal.stream.write("]" ASCII_EOL);
+        }
     }        
 }
 
 static void warning_mem (uint_fast16_t state)
 {
-    report_message("Embroidery plugin failed to initialize, no NVS storage for settings!", Message_Warning);
+    report_message("ATC plugin: no NVS storage for settings, changes are lost at a restart!", Message_Warning);
 }
 
 // Claim HAL tool change entry points and clear current tool offsets.
@@ -499,55 +3961,33 @@ void my_plugin_init (void)
     hal.tool.select = tool_select;
     hal.tool.change = tool_change;
 
-    if((nvs_address = nvs_alloc(sizeof(plugin_settings_t)))) {
-         settings_register(&setting_details);
-    } else {
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = atc_execute_realtime;
+
+    on_realtime_report = grbl.on_realtime_report;
+    grbl.on_realtime_report = atc_realtime_report;
+
+    on_program_completed = grbl.on_program_completed;
+    grbl.on_program_completed = atc_program_completed;
+
+    atc_commands.on_get_commands = grbl.on_get_commands;
+    grbl.on_get_commands = atc_get_commands;
+
+    // The settings are allocated first and stay where earlier releases had them. The optional
+    // blocks follow smallest first, each of them is not kept if there is no room left for it.
+    if((nvs_address = nvs_alloc(ATC_SETTINGS_NVS)) == 0)
         protocol_enqueue_rt_command(warning_mem);
-    }
- 
+
+    checkpoint_address = nvs_block_alloc(sizeof(atc_checkpoint_t), "checkpoint");
+    occupancy_address = nvs_block_alloc(sizeof(atc_occupancy_t), "pocket occupancy");
+    tlo_address = nvs_block_alloc(sizeof(atc_tlo_cache_t), "tool lengths");
+    map_address = nvs_block_alloc(ATC_MAP_NVS, "pocket map");
+    stats_address = nvs_block_alloc(sizeof(atc_stats_t), "statistics");
+
+    settings_register(&setting_details);
+
     if(driver_reset == NULL) {
         driver_reset = hal.driver_reset;
         hal.driver_reset = reset;
     }
 }
-
-void debug_output(char* message, coord_data_t *target, plan_line_data_t *pl_data) {
-
-#ifdef DEBUG
-    hal.stream.write("[R-ATC]: ");
-    hal.stream.write(message);
-    hal.stream.write(ASCII_EOL);
-
-    if(target != NULL) {
-        hal.stream.write(ASCII_EOL);
-        hal.stream.write("Target:" ASCII_EOL);
-        hal.stream.write("X: ");
-        hal.stream.write( ftoa(target->x, 3) );
-        hal.stream.write(ASCII_EOL);
-        hal.stream.write("y: ");
-        hal.stream.write( ftoa(target->y, 3) );
-        hal.stream.write(ASCII_EOL);
-        hal.stream.write("z: ");
-        hal.stream.write( ftoa(target->z, 3) );
-        hal.stream.write(ASCII_EOL);
-    }
-
-    if(pl_data != NULL) {
-        hal.stream.write(ASCII_EOL "Plan:" ASCII_EOL);
-        hal.stream.write("Feed Rate:");
-        hal.stream.write(ftoa(pl_data->feed_rate,3));
-        hal.stream.write(ASCII_EOL);
-        hal.stream.write("Spindle RPM:");
-        hal.stream.write(ftoa(pl_data->spindle.rpm,3));
-        hal.stream.write(ASCII_EOL);    
-        hal.stream.write("Spindle State:");
-        char buffer[8U] = ""; /*the output buffer*/ 
-        
-        sprintf (buffer, "%d", pl_data->spindle.state.value);    
-        hal.stream.write(buffer);
-        hal.stream.write(ASCII_EOL);
-
-        hal.stream.write(ASCII_EOL);
-    }
-#endif
-}
\ No newline at end of file
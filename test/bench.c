@@ -0,0 +1,171 @@
+/*
+  bench.c - tool change cycle times across magazine layouts on the simulated machine
+
+  For each layout the first tool is loaded, then swapped for the last and then for the one in the
+  middle of the magazine. Reported are the simulated time of the three changes, the moves planned,
+  the times the planner ran empty and the spindle state changes. The changes are run again in swap
+  mode with a keep-out box between the work area and the magazine and a divider between two pockets,
+  a move through a box fails the bench. Last tools without a pocket are changed by hand, the one
+  taken out is staged in the free pocket when there is one.
+*/
+
+#include "sim.h"
+
+typedef struct {
+    float    time;                      // s
+    uint32_t moves;
+    uint32_t syncs;
+    uint32_t spindle_changes;
+    uint32_t collisions;
+} bench_totals_t;
+
+static tool_data_t next;
+static bool failed = false;
+
+static void bench_tool_change (uint32_t to, bench_totals_t *totals)
+{
+    uint32_t start;
+    status_code_t status;
+
+    next.tool_id = to;
+    hal.tool.select(&next, true);
+
+    sim_settle();
+    start = sim.now;
+    status = sim_m6(0);
+    sim_settle();
+
+    if(status != Status_OK || current_tool.tool_id != to || sim.spindle_tool != to)
+        sim_fail("tool change failed");
+
+    totals->time += (float)(sim.now - start) / 1000.0f;
+    totals->moves += sim.moves;
+    totals->syncs += sim.syncs;
+    totals->spindle_changes += sim.spindle_changes;
+    totals->collisions += sim.collisions;
+}
+
+static void bench_layout (uint8_t pockets, uint8_t alignment, uint8_t direction, uint8_t recognition, bool keepout)
+{
+    bench_totals_t totals = {0};
+
+    sim_settings();
+    my_settings.number_of_pockets = pockets;
+    my_settings.alignment = alignment;
+    my_settings.direction = direction;
+    my_settings.tool_recognition = recognition;
+
+    if(keepout) {
+        my_settings.swap_mode = true;
+        my_settings.keepout_margin = 2.0f;
+        my_settings.keepout[0].x_min = 150.0f;
+        my_settings.keepout[0].x_max = 350.0f;
+        my_settings.keepout[0].y_min = 100.0f;
+        my_settings.keepout[0].y_max = 160.0f;
+        my_settings.keepout[0].z_top = 60.0f;
+    }
+
+    sim.failure = NULL;
+
+    // With a divider between pockets 2 and 3 the spindle cannot travel along the rack at the traverse height.
+    if(!sim_magazine() || (keepout && !sim_divider(1))) {
+        printf("P%u: %s\n", pockets, geometry.error);
+        failed = true;
+        return;
+    }
+
+    // Every layout starts from an empty spindle in the work area.
+    memset(&current_tool, 0, sizeof(tool_data_t));
+    sim.spindle_tool = 0;
+    sim_move_to(400.0f, 300.0f, 60.0f);
+
+    bench_tool_change(1, &totals);
+    bench_tool_change(pockets, &totals);
+    bench_tool_change(pockets / 2, &totals);
+
+    printf("P%u,%c%c,%-5s T: %6.2f s  M: %3u  S: %2u  R: %2u",
+            pockets, alignment ? 'Y' : 'X', direction ? '-' : '+', recognition ? "REC" : "NOREC",
+             (double)totals.time, (unsigned)totals.moves, (unsigned)totals.syncs, (unsigned)totals.spindle_changes);
+    if(keepout)
+        printf("  C: %u", (unsigned)totals.collisions);
+    if(sim.failure) {
+        printf("  FAIL %s: %s", phase_name[sim.failure_phase], sim.failure);
+        failed = true;
+    }
+    printf("\n");
+}
+
+static void bench_manual (void)
+{
+    uint16_t pocket;
+    bench_totals_t totals = {0};
+
+    sim_settings();
+    my_settings.number_of_pockets = 6;
+    my_settings.manual_x_pos = 400.0f;
+    my_settings.manual_y_pos = 0.0f;
+
+    sim.failure = NULL;
+
+    if(!sim_magazine()) {
+        printf("Manual: %s\n", geometry.error);
+        failed = true;
+        return;
+    }
+
+    // Leave the last pocket free for tool 7.
+    pocket_map.tool_id[5] = sim.pocket_tool[6] = 0;
+    pocket_map_index();
+
+    memset(&current_tool, 0, sizeof(tool_data_t));
+    sim.spindle_tool = 0;
+    sim_move_to(400.0f, 300.0f, 60.0f);
+
+    bench_tool_change(1, &totals);
+    bench_tool_change(7, &totals);
+    bench_tool_change(8, &totals);
+
+    for(pocket = 1; pocket <= geometry.n_pockets && sim.pocket_tool[pocket] != 7; pocket++);
+
+    if(pocket > geometry.n_pockets || pocket_map.tool_id[pocket - 1] != 7)
+        sim_fail("manual tool not staged");
+
+    // No pocket is free for tool 8, it is taken out by hand.
+    bench_tool_change(2, &totals);
+
+    printf("Manual P6     T: %6.2f s  M: %3u  S: %2u  R: %2u",
+            (double)totals.time, (unsigned)totals.moves, (unsigned)totals.syncs, (unsigned)totals.spindle_changes);
+    if(sim.failure) {
+        printf("  FAIL %s: %s", phase_name[sim.failure_phase], sim.failure);
+        failed = true;
+    }
+    printf("\n");
+}
+
+int main (void)
+{
+    static const uint8_t pockets[] = { 6, 12, 24 };
+
+    uint_fast8_t idx;
+    uint8_t alignment, direction, recognition, keepout;
+
+    sim_init();
+
+    for(keepout = 0; keepout < 2; keepout++) {
+
+        printf(keepout ? "With a keep-out box:\n" : "Open magazine:\n");
+
+        for(idx = 0; idx < sizeof(pockets); idx++) {
+            for(alignment = 0; alignment < 2; alignment++) {
+                for(direction = 0; direction < 2; direction++) {
+                    for(recognition = 0; recognition < 2; recognition++)
+                        bench_layout(pockets[idx], alignment, direction, recognition, keepout);
+                }
+            }
+        }
+    }
+
+    bench_manual();
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,373 @@
+/*
+  cases.c - targeted checks of the plugin against the simulated machine
+
+  Feed hold: a tool change is held by the operator at every realtime loop iteration it runs through
+  in turn. The sequence must not plan moves or start the cycle while held, and must complete the
+  change once the operator resumes.
+
+  Phase timing: every phase of a change with recognition and measuring is timed, with the planner
+  blocks keeping the line number of the program.
+
+  IRQ latch: the recognition sensor port is claimed when the settings are loaded, after the plugin is
+  initialized, and its edges are latched by the interrupt handler during the sweep. All cases run with
+  the edges latched.
+
+  Legacy settings: an image written by a release before the versioned image is converted when loaded.
+
+  NVS blocks: a stored block written with another version is discarded and reported on its own, the
+  others are kept. A block without NVS storage is reported and not kept, the settings are still used.
+  The tools of the pockets above those kept in NVS are in their numbered pockets after a restart.
+
+  Dust cover: the output is claimed when the settings enabling it are loaded, and it is opened for
+  each change and closed again.
+
+  Scan: $ATCSCAN moves between the rows of the magazine on the paths a tool change takes, clear of
+  the keep-out boxes, and ends at safe clearance.
+
+  Manual TLO: a tool put in by hand is measured again with the full search, its cached length is not
+  used to predict the contact.
+*/
+
+#include "sim.h"
+
+static tool_data_t next;
+static bool dust_cover = false;         // change tools with the dust cover on an output
+static bool failed = false;
+
+static void case_report (const char *name, uint32_t runs)
+{
+    printf("%-12s %5u runs", name, (unsigned)runs);
+    if(sim.failure) {
+        printf("  FAIL %s: %s", phase_name[sim.failure_phase], sim.failure);
+        failed = true;
+    } else
+        printf("  OK");
+    printf("\n");
+}
+
+// Load tool 1 from an empty spindle in the work area and change it for tool 3,
+// holding the change at the given realtime loop iteration if not 0.
+static uint32_t case_change (uint32_t feed_hold_at)
+{
+    status_code_t status;
+
+    sim_settings();
+    my_settings.dust_cover = dust_cover;
+    if(!sim_magazine()) {
+        sim_fail(geometry.error);
+        return 0;
+    }
+
+    memset(&current_tool, 0, sizeof(tool_data_t));
+    sim.spindle_tool = 0;
+    sim_move_to(400.0f, 300.0f, 60.0f);
+
+    next.tool_id = 1;
+    hal.tool.select(&next, true);
+    if(sim_m6(0) != Status_OK)
+        sim_fail("tool 1 not loaded");
+    sim_settle();
+
+    next.tool_id = 3;
+    hal.tool.select(&next, true);
+    sim.feed_hold_at = feed_hold_at;
+    status = sim_m6(0);
+    sim_settle();
+
+    if(status != Status_OK || current_tool.tool_id != 3 || sim.spindle_tool != 3)
+        sim_fail("tool change not completed after a feed hold");
+
+    if(sim.feed_hold_at || sim.feed_hold)
+        sim_fail("feed hold not entered");
+
+    return sim.calls;
+}
+
+static void case_feed_hold (void)
+{
+    uint32_t at, calls;
+
+    sim.failure = NULL;
+    calls = case_change(0);
+
+    for(at = 1; at < calls && !sim.failure; at++)
+        case_change(at);
+
+    case_report("Feed hold", calls);
+}
+
+static void case_timing (void)
+{
+    atc_phase_t phase;
+
+    sim.failure = NULL;
+    memset(&stats, 0, sizeof(atc_stats_t));
+    case_change(0);
+
+    for(phase = ATC_UnloadApproach; phase <= ATC_Return; phase++) {
+        if(stats.phase[phase].count == 0)
+            sim_fail("phase not timed");
+    }
+
+    if(stats.phase[ATC_STATS_CYCLE].count != 2)
+        sim_fail("tool changes not timed");
+
+    case_report("Timing", 2);
+}
+
+// The nut of the loaded tool clears the sensor once, the edge is latched where it passed the beam.
+static void case_irq (void)
+{
+    int32_t edge;
+
+    sim.failure = NULL;
+
+    if(!latch.irq)
+        sim_fail("interrupt handler not registered");
+
+    case_change(0);
+
+    edge = lroundf(sim_sensor_z(3) * settings.axis[Z_AXIS].steps_per_mm);
+
+    if(sequence.recognition != 'Y')
+        sim_fail("loaded tool not recognized");
+    else if(latch.count != 1 || latch.edge[0].blocked || latch.edge[0].position != edge)
+        sim_fail("sensor edge not latched");
+
+    case_report("IRQ latch", 1);
+}
+
+// The dust cover output is claimed when the settings enabling it are loaded at the next boot.
+static void case_dust_cover (void)
+{
+    sim.failure = NULL;
+
+    sim_settings();
+    my_settings.dust_cover = dust_cover = true;
+    sim_settings_details->save();
+    sim_settings_details->load();
+
+    sim.cover_opens = 0;
+    case_change(0);
+
+    if(sim.cover_opens != 2 || sim.cover_open)
+        sim_fail("dust cover not switched");
+
+    dust_cover = false;
+
+    case_report("Dust cover", 2);
+}
+
+// Scan two rows in swap mode with a keep-out box between the rows, reaching above the traverse height.
+static void case_scan (void)
+{
+    status_code_t status;
+
+    sim.failure = NULL;
+
+    sim_settings();
+    my_settings.swap_mode = true;
+    my_settings.rows = 2;
+    my_settings.row_offset = 40.0f;
+    my_settings.keepout[0].x_min = 90.0f;
+    my_settings.keepout[0].x_max = 270.0f;
+    my_settings.keepout[0].y_min = 25.0f;
+    my_settings.keepout[0].y_max = 35.0f;
+    my_settings.keepout[0].z_top = 50.0f;
+
+    if(!sim_magazine()) {
+        sim_fail(geometry.error);
+        case_report("Scan", 0);
+        return;
+    }
+
+    sim_move_to(400.0f, 300.0f, 60.0f);
+    sim.calls = sim.collisions = 0;
+
+    status = scan_cmd(STATE_IDLE, NULL);
+
+    if(status != Status_OK || !occupancy.valid)
+        sim_fail("scan not completed");
+    else if(fabsf(sim.position.z - my_settings.tool_z_safe_clearance) > SIM_EPSILON)
+        sim_fail("scan not ended at safe clearance");
+
+    // The simulated sensor does not see the nuts in the pockets, do not check later changes against the scan.
+    scan_cmd(STATE_IDLE, "0");
+
+    case_report("Scan", 1);
+}
+
+// A tool put in by hand is measured with the full search from the start height, although its length is cached.
+static void case_manual_tlo (void)
+{
+    static const uint32_t tools[] = { 7, 1, 7 };
+
+    uint_fast8_t idx;
+    atc_tlo_entry_t *entry;
+
+    sim.failure = NULL;
+
+    sim_settings();
+    my_settings.number_of_pockets = 6;
+    my_settings.manual_x_pos = 400.0f;
+    my_settings.manual_y_pos = 0.0f;
+    my_settings.toolsetter_margin = 5.0f;
+    my_settings.tlo_cache = true;
+
+    if(!sim_magazine()) {
+        sim_fail(geometry.error);
+        case_report("Manual TLO", 0);
+        return;
+    }
+
+    memset(&current_tool, 0, sizeof(tool_data_t));
+    sim.spindle_tool = 0;
+    sim_move_to(400.0f, 300.0f, 60.0f);
+
+    for(idx = 0; idx < sizeof(tools) / sizeof(uint32_t) && !sim.failure; idx++) {
+        next.tool_id = tools[idx];
+        hal.tool.select(&next, true);
+        if(sim_m6(0) != Status_OK || current_tool.tool_id != tools[idx] || sim.spindle_tool != tools[idx])
+            sim_fail("tool change failed");
+        sim_settle();
+    }
+
+    if(sim.probes == 0 || fabsf(sim.probe_z - my_settings.toolsetter_z_start_pos) > SIM_EPSILON)
+        sim_fail("tool put in by hand not searched for from the start height");
+    else if((entry = tlo_cache_find(7)) == NULL || !entry->valid)
+        sim_fail("length of the tool put in by hand not cached");
+
+    case_report("Manual TLO", 3);
+}
+
+// Settings written by a release before the versioned image are converted, and tool N is assigned to pocket N.
+static void case_legacy (void)
+{
+    float safe_clearance = 75.0f;
+    uint16_t pocket;
+    plugin_settings_legacy_t legacy;
+    uint8_t raw[sizeof(plugin_settings_legacy_t)];
+
+    sim.failure = NULL;
+
+    memset(&legacy, 0, sizeof(plugin_settings_legacy_t));
+    legacy.alignment = 1;
+    legacy.direction = 1;
+    legacy.number_of_pockets = 10;
+    legacy.pocket_offset = 50;
+    legacy.pocket_1_x_pos = 120.0f;
+    legacy.pocket_1_y_pos = 20.0f;
+    legacy.tool_engagement_feed_rate = 1800;
+    legacy.tool_setter = true;
+    legacy.toolsetter_seek_rate = 200;
+    legacy.toolsetter_x_pos = 70.0f;
+    legacy.toolrecognition_detect_zone_1 = 18.0f;
+    legacy.toolrecognition_detect_zone_2 = 24.0f;
+    memcpy(raw, &legacy, sizeof(plugin_settings_legacy_t));
+
+    // Decimal settings were written as floats into 16 bit fields, the last of them is intact.
+    memcpy(&raw[offsetof(plugin_settings_legacy_t, tool_z_safe_clearance)], &safe_clearance, sizeof(float));
+
+    hal.nvs.memcpy_to_nvs(nvs_address, raw, sizeof(raw), true);
+    memset(&pocket_map, 0, sizeof(atc_pocket_map_t));
+
+    sim_settings_details->load();
+
+    if(sim.nvs[nvs_address] != ATC_SETTINGS_MAGIC)
+        sim_fail("settings not written in the versioned image");
+    else if(my_settings.alignment != 1 || my_settings.direction != 1 || my_settings.number_of_pockets != 10 ||
+             my_settings.pocket_offset != 50 || my_settings.pocket_1_x_pos != 120.0f || my_settings.pocket_1_y_pos != 20.0f ||
+              my_settings.tool_engagement_feed_rate != 1800 || !my_settings.tool_setter || my_settings.toolsetter_seek_rate != 200 ||
+               my_settings.toolsetter_x_pos != 70.0f || my_settings.toolrecognition_detect_zone_1 != 18.0f ||
+                my_settings.toolrecognition_detect_zone_2 != 24.0f || my_settings.tool_z_safe_clearance != safe_clearance)
+        sim_fail("settings not converted");
+
+    for(pocket = 0; pocket < ATC_MAX_POCKETS && !sim.failure; pocket++) {
+        if(pocket_map.tool_id[pocket] != pocket + 1)
+            sim_fail("tool not assigned to its numbered pocket");
+    }
+
+    sim_settings();
+    sim_settings_details->save();
+    sim_settings_details->load();
+
+    case_report("Legacy", 1);
+}
+
+// Discard the stored tool lengths by their version, then load and save without NVS storage for the pocket map and the settings.
+static void case_nvs (void)
+{
+    nvs_address_t address = sim.nvs_next, settings_address = nvs_address, pocket_map_address = map_address;
+
+    sim.failure = NULL;
+
+    sim_settings();
+    pocket_map_restore();
+    pocket_map.tool_id[0] = 9;
+    pocket_map.tool_id[ATC_NVS_POCKETS] = 9;
+    pocket_map_save();
+    occupancy.valid = true;
+    occupancy_save();
+    tlo_cache.entry[0].tool_id = 9;
+    tlo_cache.entry[0].valid = true;
+    tlo_cache_save();
+
+    sim.nvs[tlo_address] = ATC_TLO_VERSION + 1;
+    sim.warning[0] = '\0';
+    sim_settings_details->load();
+
+    if(tlo_cache.entry[0].valid || sim.nvs[tlo_address] != ATC_TLO_VERSION)
+        sim_fail("tool lengths of another version not discarded");
+    else if(strcmp(sim.warning, "ATC: tool lengths discarded"))
+        sim_fail("discarded tool lengths not reported");
+    else if(pocket_map.tool_id[0] != 9 || !occupancy.valid)
+        sim_fail("blocks stored with their version not kept");
+    else if(pocket_map.tool_id[ATC_NVS_POCKETS] != ATC_NVS_POCKETS + 1)
+        sim_fail("tool of a pocket not kept in NVS not in its numbered pocket");
+
+    sim.nvs_next = SIM_NVS_SIZE - 64;
+    if(nvs_block_alloc(ATC_MAP_NVS, "pocket map") != 0 || strcmp(sim.warning, "ATC: pocket map not kept, no NVS storage"))
+        sim_fail("pocket map without NVS storage not reported");
+    else if(nvs_block_alloc(sizeof(atc_checkpoint_t), "checkpoint") == 0)
+        sim_fail("checkpoint not allocated after the pocket map");
+    sim.nvs_next = address;
+
+    nvs_address = map_address = 0;
+    sim_settings_details->load();
+    my_settings.number_of_pockets = 10;
+    sim_settings_details->save();
+    nvs_address = settings_address;
+    map_address = pocket_map_address;
+
+    if(pocket_map.tool_id[0] != 1)
+        sim_fail("pocket map without NVS storage not restored");
+    else if(sim.nvs[nvs_address] != ATC_SETTINGS_MAGIC || sim.nvs[pocket_map_address + 1] != 9)
+        sim_fail("settings without NVS storage written");
+
+    pocket_map_restore();
+    sim_settings();
+    sim_settings_details->save();
+    sim_settings_details->load();
+
+    case_report("NVS blocks", 1);
+}
+
+int main (void)
+{
+    // The recognition sensor edges are latched by the interrupt handler.
+    hal.port.register_interrupt_handler = sim_register_interrupt_handler;
+
+    sim_init();
+
+    case_irq();
+    case_legacy();
+    case_nvs();
+    case_dust_cover();
+    case_scan();
+    case_manual_tlo();
+
+    case_feed_hold();
+    case_timing();
+
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,1050 @@
+/*
+  sim.h - host simulation of the grblHAL core for the RapidChange ATC plugin
+
+  The plugin is built into the test program together with a simulated machine: planned moves
+  complete in simulated time, a tool moves between the spindle and a pocket when its clamping nut
+  is (un)threaded and the tool setter reports a length per tool. The plugin source is included so
+  the tests can reach its state, include this file from one translation unit only.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "hal.h"
+#include "motion_control.h"
+#include "protocol.h"
+#include "grbl/nvs_buffer.h"
+#include "grbl/nuts_bolts.h"
+#include "grbl/vfs.h"
+
+parser_state_t gc_state;
+system_t sys;
+settings_t settings;
+grbl_hal_t hal;
+grbl_t grbl;
+
+#include "../my_plugin.c"
+
+#define SIM_PLANNER_SIZE    16          // blocks the simulated planner holds
+#define SIM_TICK            5           // ms an iteration of the realtime loop takes when no motion is planned
+#define SIM_MAX_CALLS       4000        // realtime loop iterations before a tool change is considered stuck
+#define SIM_HOLD            3           // iterations the operator takes for a manual change
+#define SIM_FEED_HOLD       5           // iterations before the operator resumes from a feed hold
+#define SIM_NO_POCKET       0
+#define SIM_NVS_SIZE        4096
+#define SIM_EPSILON         0.001f
+#define SIM_SETTER_RADIUS   5.0f        // tool setter pad radius
+#define SIM_SEGMENT         1.0f        // mm of a vertical move executed per realtime loop iteration when sensor edges are latched
+
+typedef struct {
+    coord_data_t target;
+    uint32_t     end;                   // ms at which the move completes
+    uint16_t     pocket;                // pocket plunged into, SIM_NO_POCKET if not a plunge
+    bool         ccw;                   // unthreading plunge
+    int32_t      line_number;
+} sim_block_t;
+
+typedef struct {
+    uint32_t     now;                   // simulated time in ms
+    coord_data_t position;              // position of the last completed move
+    coord_data_t planned;               // position at the end of the last planned move
+    sim_block_t  block[SIM_PLANNER_SIZE];
+    uint_fast8_t head;
+    uint_fast8_t count;
+    bool         cycle;                 // planned motion was started by a cycle start
+    uint32_t     motion_end;            // ms at which the planned motion completes
+    spindle_state_t spindle;
+    uint32_t     spindle_tool;          // tool physically in the spindle, 0 if empty
+    uint32_t     pocket_tool[ATC_MAX_POCKETS + 1];
+    float        z_floor;               // lowest engagement height of the magazine
+    uint32_t     calls;                 // realtime loop iterations of the current command
+    uint32_t     reset_at;              // iteration to reset at, 0 for none
+    bool         reset;                 // the current command was reset
+    atc_phase_t  reset_phase;           // phase the reset happened in
+    uint32_t     blocked_reads;         // recognition sensor reads to report blocked
+    bool         cover_open;            // dust cover output state
+    uint32_t     cover_opens;
+    ioport_interrupt_callback_ptr irq;  // recognition sensor interrupt handler, NULL if the sensor is polled
+    uint8_t      irq_port;
+    uint32_t     moves;
+    uint32_t     syncs;                 // times the planner ran empty during a tool change
+    uint32_t     spindle_changes;
+    uint32_t     probes;
+    float        probe_z;               // Z the first probe of the current command started from
+    uint32_t     collisions;            // moves through a keep-out box
+    bool         hold_requested;
+    uint_fast8_t hold;                  // iterations left of a tool change hold
+    uint32_t     feed_hold_at;          // iteration to enter a feed hold at, 0 for none
+    uint_fast8_t feed_hold;             // iterations left of a feed hold
+    char         prompt[96];            // last manual tool change prompt
+    char         warning[96];           // last warning reported
+    bool         verbose;               // print moves
+    const char  *failure;
+    atc_phase_t  failure_phase;
+    uint8_t      nvs[SIM_NVS_SIZE];
+    nvs_address_t nvs_next;
+} sim_t;
+
+static sim_t sim;
+static tool_data_t sim_tool;            // tool the parser state points to
+static setting_details_t *sim_settings_details;
+
+static void sim_fail (const char *reason)
+{
+    if(sim.failure == NULL) {
+        sim.failure = reason;
+        sim.failure_phase = sequence.phase;
+    }
+}
+
+// Z position of the spindle at which a tool touches the tool setter.
+static float sim_tool_contact (uint32_t tool_id)
+{
+    return my_settings.toolsetter_z_start_pos - my_settings.toolsetter_max_travel + (tool_id ? 10.0f + (float)(tool_id % 7) * 2.5f : -10.0f);
+}
+
+static inline bool sim_at (const float *target, float x, float y)
+{
+    return fabsf(target[X_AXIS] - x) < SIM_EPSILON && fabsf(target[Y_AXIS] - y) < SIM_EPSILON;
+}
+
+static inline bool sim_over_setter (const float *target)
+{
+    return hypotf(target[X_AXIS] - my_settings.toolsetter_x_pos, target[Y_AXIS] - my_settings.toolsetter_y_pos) < SIM_SETTER_RADIUS;
+}
+
+// Time in ms the machine takes for a move, with a trapezoidal velocity profile limited by the axis settings.
+// Every move starts and ends at rest.
+static uint32_t sim_move_time (const float *from, const float *to, plan_line_data_t *pl_data)
+{
+    uint_fast8_t idx;
+    float delta[N_AXIS], distance = 0.0f, unit, rate, accel = SOME_LARGE_VALUE, time;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        delta[idx] = to[idx] - from[idx];
+        distance += delta[idx] * delta[idx];
+    }
+
+    if((distance = sqrtf(distance)) == 0.0f)
+        return 0;
+
+    rate = pl_data->condition.rapid_motion ? SOME_LARGE_VALUE : pl_data->feed_rate;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        if(delta[idx] != 0.0f) {
+            unit = fabsf(delta[idx]) / distance;
+            rate = min(rate, settings.axis[idx].max_rate / unit);
+            accel = min(accel, settings.axis[idx].acceleration / unit);
+        }
+    }
+
+    if(rate <= 0.0f || accel <= 0.0f) {
+        sim_fail("move without a feed rate");
+        return 0;
+    }
+
+    if(distance >= rate * rate / accel)
+        time = distance / rate + rate / accel;
+    else
+        time = 2.0f * sqrtf(distance / accel);
+
+    return (uint32_t)lroundf(time * 60000.0f);
+}
+
+// Interval of a segment inside the open interval (lo, hi) along one axis, narrows [t0, t1].
+static bool sim_clip (float from, float to, float lo, float hi, float *t0, float *t1)
+{
+    float delta = to - from, ta, tb;
+
+    if(fabsf(delta) < 1e-9f)
+        return from > lo && from < hi;
+
+    ta = (lo - from) / delta;
+    tb = (hi - from) / delta;
+    *t0 = max(*t0, min(ta, tb));
+    *t1 = min(*t1, max(ta, tb));
+
+    return *t1 - *t0 > 1e-6f;
+}
+
+// Check a move against the keep-out boxes as set, independent of the clearance the plugin plans with.
+// A move starting inside a box is how the plugin gets out of it.
+static bool sim_crosses_keepout (const float *from, const float *to)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < ATC_MAX_KEEPOUTS; idx++) {
+
+        atc_keepout_settings_t *box = &my_settings.keepout[idx];
+        float t0 = 0.0f, t1 = 1.0f;
+
+        if(!(box->x_max > box->x_min && box->y_max > box->y_min))
+            continue;
+
+        if(from[X_AXIS] > box->x_min && from[X_AXIS] < box->x_max && from[Y_AXIS] > box->y_min && from[Y_AXIS] < box->y_max && from[Z_AXIS] < box->z_top)
+            continue;
+
+        if(sim_clip(from[X_AXIS], to[X_AXIS], box->x_min + SIM_EPSILON, box->x_max - SIM_EPSILON, &t0, &t1) &&
+            sim_clip(from[Y_AXIS], to[Y_AXIS], box->y_min + SIM_EPSILON, box->y_max - SIM_EPSILON, &t0, &t1) &&
+             sim_clip(from[Z_AXIS], to[Z_AXIS], -SOME_LARGE_VALUE, box->z_top - SIM_EPSILON, &t0, &t1))
+            return true;
+    }
+
+    return false;
+}
+
+// Pocket the spindle is over, SIM_NO_POCKET if none.
+static uint16_t sim_pocket_at (const float *position)
+{
+    uint16_t idx;
+    coord_data_t location;
+
+    for(idx = 0; idx < geometry.n_pockets; idx++) {
+        location = get_pocket_location(idx);
+        if(sim_at(position, location.x, location.y))
+            return idx + 1;
+    }
+
+    return SIM_NO_POCKET;
+}
+
+// Z position of the spindle at which the clamping nut passes the recognition sensor of a pocket,
+// in the middle of the detect zones.
+static float sim_sensor_z (uint16_t pocket)
+{
+    return pocket_z_offset(pocket - 1) + (my_settings.toolrecognition_detect_zone_1 + my_settings.toolrecognition_detect_zone_2) / 2.0f;
+}
+
+// The clamping nut of a tool in the spindle blocks the recognition sensor below the middle of the detect zones.
+static bool sim_sensor_blocked (const float *position)
+{
+    uint16_t pocket = sim_pocket_at(position);
+
+    return sim.spindle_tool && pocket != SIM_NO_POCKET && position[Z_AXIS] < sim_sensor_z(pocket);
+}
+
+// Check a move when planned and find the pocket it plunges into with the spindle on, if any.
+// The plugin switches the spindle immediately, the state when the move is planned is the one it runs with.
+// Z may only descend below the lowest engagement height vertically over a pocket or the tool setter.
+static uint16_t sim_observe (const float *from, const float *to, plan_line_data_t *pl_data)
+{
+    uint16_t pocket = sim_pocket_at(to);
+    bool vertical = sim_at(to, from[X_AXIS], from[Y_AXIS]);
+
+    if(to[Z_AXIS] < sim.z_floor - SIM_EPSILON && to[Z_AXIS] < from[Z_AXIS] - SIM_EPSILON &&
+        !(vertical && (pocket != SIM_NO_POCKET || (my_settings.tool_setter && sim_over_setter(to)))))
+        sim_fail("Z below engagement height outside a pocket");
+
+    if(sim_over_setter(to) && to[Z_AXIS] < sim_tool_contact(sim.spindle_tool) - SIM_EPSILON)
+        sim_fail("tool driven into the tool setter");
+
+    if(geometry.n_keepouts && sim_crosses_keepout(from, to)) {
+        sim.collisions++;
+        sim_fail("move through a keep-out box");
+    }
+
+    if(pocket == SIM_NO_POCKET || !vertical || !sim.spindle.on || pl_data->condition.rapid_motion ||
+        to[Z_AXIS] >= from[Z_AXIS] || to[Z_AXIS] > my_settings.tool_z_engagement + pocket_z_offset(pocket - 1) + SIM_EPSILON)
+        return SIM_NO_POCKET;
+
+    return pocket;
+}
+
+// A completed plunge (un)threads the nut. Plunging again into a nut already (un)threaded does nothing,
+// as when a tool change is resumed or the recognition sensor check is retried.
+static void sim_engage (uint16_t pocket, bool ccw)
+{
+    if(ccw) {
+        if(sim.spindle_tool == 0)
+            return;
+        if(sim.pocket_tool[pocket])
+            sim_fail("tool dropped in an occupied pocket");
+        sim.pocket_tool[pocket] = sim.spindle_tool;
+        sim.spindle_tool = 0;
+    } else {
+        if(sim.pocket_tool[pocket] == 0)
+            return;
+        if(sim.spindle_tool)
+            sim_fail("threading a loaded spindle");
+        else if(sequence.phase != ATC_Idle && sim.pocket_tool[pocket] != sequence.load_tool)
+            sim_fail("wrong tool picked");
+        sim.spindle_tool = sim.pocket_tool[pocket];
+        sim.pocket_tool[pocket] = 0;
+    }
+}
+
+static void sim_update_position (void)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        sys.position[idx] = lroundf(sim.position.values[idx] * settings.axis[idx].steps_per_mm);
+}
+
+// Call the interrupt handler if the recognition sensor changed state since the spindle was at the given
+// state and Z position, with the position where the nut passed the sensor.
+static void sim_sensor_edge (bool blocked, float z)
+{
+    int32_t position = sys.position[Z_AXIS];
+    uint16_t pocket = sim_pocket_at(sim.position.values);
+    float edge;
+
+    if(sim.irq == NULL || sim_sensor_blocked(sim.position.values) == blocked)
+        return;
+
+    if(pocket != SIM_NO_POCKET && (edge = sim_sensor_z(pocket)) > min(z, sim.position.z) && edge < max(z, sim.position.z))
+        sys.position[Z_AXIS] = lroundf(edge * settings.axis[Z_AXIS].steps_per_mm);
+
+    sim.irq(sim.irq_port, !blocked);
+    sys.position[Z_AXIS] = position;
+}
+
+// Complete the next planned move. With sensor edges latched a vertical move is executed a segment
+// at a time, for the realtime loop to see Z move.
+static void sim_complete_block (void)
+{
+    sim_block_t *block = &sim.block[sim.head];
+    bool blocked = sim_sensor_blocked(sim.position.values);
+    float z = sim.position.z;
+
+    if(sim.irq && sim_at(block->target.values, sim.position.x, sim.position.y) && fabsf(block->target.z - z) > SIM_SEGMENT) {
+        sim.position.z += block->target.z > z ? SIM_SEGMENT : -SIM_SEGMENT;
+        sim_update_position();
+        sim_sensor_edge(blocked, z);
+        return;
+    }
+
+    sim.now = max(sim.now, block->end);
+    memcpy(&sim.position, &block->target, sizeof(coord_data_t));
+    sim_update_position();
+
+    if(block->pocket != SIM_NO_POCKET)
+        sim_engage(block->pocket, block->ccw);
+
+    sim_sensor_edge(blocked, z);
+
+    sim.head = (sim.head + 1) % SIM_PLANNER_SIZE;
+    sim.cycle = --sim.count != 0;
+}
+
+static void sim_settle (void)
+{
+    while(sim.count)
+        sim_complete_block();
+
+    sim.now = max(sim.now, sim.motion_end);
+}
+
+// Complete the planned motion and run the realtime loop once, as the idle main loop does.
+static void sim_idle (void)
+{
+    sim_settle();
+    grbl.on_execute_realtime(state_get());
+}
+
+// Reset as EXEC_RESET does, motion not completed is lost.
+static void sim_reset (void)
+{
+    sim.count = 0;
+    sim.cycle = false;
+    sim.feed_hold = 0;
+    sys.suspend = false;
+    memcpy(&sim.planned, &sim.position, sizeof(coord_data_t));
+    sim.motion_end = sim.now;
+    sim.spindle.value = 0;
+    sim.hold = 0;
+    sim.hold_requested = false;
+    sim.reset = true;
+    sim.reset_phase = sequence.phase;
+
+    hal.driver_reset();
+}
+
+// The operator does as prompted for a manual change. A tool already swapped before a reset is left in place.
+static void sim_operator (void)
+{
+    char *s;
+    uint32_t remove = 0, insert = 0;
+
+    if((s = strstr(sim.prompt, "remove T")))
+        remove = (uint32_t)strtoul(s + 8, NULL, 10);
+    if((s = strstr(sim.prompt, "insert T")))
+        insert = (uint32_t)strtoul(s + 8, NULL, 10);
+
+    *sim.prompt = '\0';
+
+    if(sim.spindle_tool == insert)
+        return;
+
+    if(sim.spindle_tool != remove)
+        sim_fail("prompted to remove the wrong tool");
+
+    sim.spindle_tool = insert;
+}
+
+/* Core entry points used by the plugin */
+
+static void sim_driver_reset (void)
+{
+}
+
+static uint32_t sim_get_elapsed_ticks (void)
+{
+    return sim.now;
+}
+
+static uint32_t sim_get_micros (void)
+{
+    return sim.now * 1000;
+}
+
+static void sim_stream_write (const char *s)
+{
+    (void)s;
+}
+
+static void sim_coolant_set_state (coolant_state_t mode)
+{
+    (void)mode;
+}
+
+static void sim_spindle_set_state (spindle_ptrs_t *spindle, spindle_state_t state, float rpm)
+{
+    (void)spindle;
+    (void)rpm;
+
+    if(state.value != sim.spindle.value)
+        sim.spindle_changes++;
+
+    sim.spindle = state;
+}
+
+static spindle_state_t sim_spindle_get_state (spindle_ptrs_t *spindle)
+{
+    (void)spindle;
+
+    return sim.spindle;
+}
+
+static spindle_ptrs_t sim_spindle = {
+    .set_state = sim_spindle_set_state,
+    .get_state = sim_spindle_get_state
+};
+
+static uint8_t sim_checksum (const uint8_t *data, uint32_t size)
+{
+    uint8_t checksum = 0;
+
+    while(size--)
+        checksum = (uint8_t)(((checksum << 1) | (checksum >> 7)) + *data++);
+
+    return checksum;
+}
+
+static nvs_transfer_result_t sim_memcpy_to_nvs (nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    if(dest + size + NVS_CRC_BYTES > SIM_NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(&sim.nvs[dest], source, size);
+    if(with_checksum)
+        sim.nvs[dest + size] = sim_checksum(source, size);
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t sim_memcpy_from_nvs (uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum)
+{
+    if(source + size + NVS_CRC_BYTES > SIM_NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(dest, &sim.nvs[source], size);
+
+    return !with_checksum || sim.nvs[source + size] == sim_checksum(dest, size) ? NVS_TransferResult_OK : NVS_TransferResult_Failed;
+}
+
+static uint8_t sim_nvs_get_byte (uint32_t addr)
+{
+    return addr < SIM_NVS_SIZE ? sim.nvs[addr] : 0xFF;
+}
+
+static void sim_nvs_put_byte (uint32_t addr, uint8_t new_value)
+{
+    if(addr < SIM_NVS_SIZE)
+        sim.nvs[addr] = new_value;
+}
+
+// Read the recognition sensor, reads can be set to report it blocked.
+static int32_t sim_wait_on_input (io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout)
+{
+    (void)type;
+    (void)port;
+    (void)wait_mode;
+    (void)timeout;
+
+    if(sim.blocked_reads) {
+        sim.blocked_reads--;
+        return 1;
+    }
+
+    return sim_sensor_blocked(sim.position.values);
+}
+
+// Set hal.port.register_interrupt_handler to this before sim_init() to latch the recognition sensor edges.
+static bool sim_register_interrupt_handler (uint8_t port, pin_irq_mode_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback)
+{
+    (void)irq_mode;
+
+    sim.irq = interrupt_callback;
+    sim.irq_port = port;
+
+    return true;
+}
+
+static void sim_digital_out (uint8_t port, bool on)
+{
+    (void)port;
+
+    if(on && !sim.cover_open)
+        sim.cover_opens++;
+
+    sim.cover_open = on;
+}
+
+static void sim_on_execute_realtime (sys_state_t state)
+{
+    (void)state;
+}
+
+static void sim_on_report_options (bool newopt)
+{
+    (void)newopt;
+}
+
+static void sim_on_realtime_report (stream_write_ptr stream_write, report_tracking_flags_t report)
+{
+    (void)stream_write;
+    (void)report;
+}
+
+static sys_commands_t *sim_on_get_commands (void)
+{
+    return NULL;
+}
+
+nvs_address_t nvs_alloc (size_t size)
+{
+    nvs_address_t address = sim.nvs_next;
+
+    if(address + size + NVS_CRC_BYTES > SIM_NVS_SIZE)
+        return 0;
+
+    sim.nvs_next += size + NVS_CRC_BYTES;
+
+    return address;
+}
+
+void settings_register (setting_details_t *details)
+{
+    sim_settings_details = details;
+}
+
+bool mc_line (float *target, plan_line_data_t *pl_data)
+{
+    sim_block_t *block;
+
+    if(sim.feed_hold)
+        sim_fail("move planned during a feed hold");
+
+    // A full planner starts the cycle as mc_line does.
+    while(plan_check_full_buffer()) {
+        sim.cycle = true;
+        if(!protocol_execute_realtime())
+            return false;
+    }
+
+    block = &sim.block[(sim.head + sim.count) % SIM_PLANNER_SIZE];
+    memcpy(&block->target, target, sizeof(coord_data_t));
+    block->pocket = sim_observe(sim.planned.values, target, pl_data);
+    block->ccw = sim.spindle.ccw;
+    block->line_number = pl_data->line_number;
+    if(block->line_number < 0)
+        sim_fail("negative line number reported by the real-time report");
+    block->end = max(sim.motion_end, sim.now) + sim_move_time(sim.planned.values, target, pl_data);
+
+    if(sim.verbose)
+        printf("%8u %s X%.3f Y%.3f Z%.3f F%.0f%s\n", (unsigned)sim.now, pl_data->condition.rapid_motion ? "G0" : "G1",
+                (double)target[X_AXIS], (double)target[Y_AXIS], (double)target[Z_AXIS], (double)pl_data->feed_rate,
+                 !sim.spindle.on ? "" : sim.spindle.ccw ? " M4" : " M3");
+
+    sim.motion_end = block->end;
+    memcpy(&sim.planned, target, sizeof(coord_data_t));
+    sim.count++;
+    sim.moves++;
+
+    return true;
+}
+
+// Probe the tool setter, motion is completed first as the probing cycle does.
+gc_probe_t mc_probe_cycle (float *target, plan_line_data_t *pl_data, gc_parser_flags_t parser_flags)
+{
+    float contact = sim_tool_contact(sim.spindle_tool);
+    coord_data_t end;
+
+    (void)parser_flags;
+
+    sim_settle();
+    sim.moves++;
+
+    // The probing move takes a planner block.
+    sim.head = (sim.head + 1) % SIM_PLANNER_SIZE;
+
+    if(sim.probes++ == 0)
+        sim.probe_z = sim.position.z;
+
+    if(!(my_settings.tool_setter && sim_over_setter(sim.position.values) && sim_at(target, sim.position.x, sim.position.y)))
+        sim_fail("probing away from the tool setter");
+
+    if(sim.position.z < contact - SIM_EPSILON)
+        sim_fail("probing from below the tool setter contact");
+
+    memcpy(&end, &sim.position, sizeof(coord_data_t));
+    end.z = max(target[Z_AXIS], contact);
+    sim.now += sim_move_time(sim.position.values, end.values, pl_data);
+    memcpy(&sim.position, &end, sizeof(coord_data_t));
+    memcpy(&sim.planned, &end, sizeof(coord_data_t));
+    sim.motion_end = sim.now;
+    sim_update_position();
+
+    if(sim.verbose)
+        printf("%8u G38 Z%.3f %s\n", (unsigned)sim.now, (double)target[Z_AXIS], target[Z_AXIS] > contact ? "no contact" : "contact");
+
+    if(target[Z_AXIS] > contact)
+        return GCProbe_FailEnd;
+
+    memcpy(sys.probe_position, sys.position, sizeof(sys.probe_position));
+
+    return GCProbe_Found;
+}
+
+void plan_data_init (plan_line_data_t *plan_data)
+{
+    memset(plan_data, 0, sizeof(plan_line_data_t));
+    plan_data->spindle.hal = &sim_spindle;
+    plan_data->spindle.state = sim.spindle;
+}
+
+plan_block_t *plan_get_current_block (void)
+{
+    static plan_block_t block[SIM_PLANNER_SIZE];
+
+    uint_fast8_t idx;
+
+    if(sim.count == 0)
+        return NULL;
+
+    // The blocks form a ring as in the planner.
+    for(idx = 0; idx < SIM_PLANNER_SIZE; idx++) {
+        block[idx].prev = &block[(idx + SIM_PLANNER_SIZE - 1) % SIM_PLANNER_SIZE];
+        block[idx].next = &block[(idx + 1) % SIM_PLANNER_SIZE];
+    }
+
+    block[sim.head].line_number = sim.block[sim.head].line_number;
+
+    return &block[sim.head];
+}
+
+bool plan_check_full_buffer (void)
+{
+    return sim.count == SIM_PLANNER_SIZE;
+}
+
+bool protocol_buffer_synchronize (void)
+{
+    sim.cycle = sim.count != 0;
+
+    do {
+        if(!protocol_execute_realtime())
+            return false;
+    } while(sim.count);
+
+    return true;
+}
+
+// An iteration of the realtime loop completes the next started move, or else takes a tick.
+// A reset and a feed hold are injected at the set iterations, motion resumes when the feed hold ends.
+bool protocol_execute_realtime (void)
+{
+    if(++sim.calls > SIM_MAX_CALLS) {
+        sim_fail("command does not complete");
+        sim_reset();
+        return false;
+    }
+
+    if(sim.reset_at && sim.calls >= sim.reset_at) {
+        sim.reset_at = 0;
+        sim_reset();
+        return false;
+    }
+
+    if(sim.feed_hold_at && sim.calls >= sim.feed_hold_at) {
+        sim.feed_hold_at = 0;
+        sim.feed_hold = SIM_FEED_HOLD;
+        sys.suspend = true;
+    }
+
+    if(sim.feed_hold) {
+        sim.now += SIM_TICK;
+        if(--sim.feed_hold == 0)
+            sys.suspend = false;
+    } else if(sim.cycle) {
+        sim_complete_block();
+        if(sim.count == 0 && sequence.phase != ATC_Idle)
+            sim.syncs++;
+    } else {
+        sim.now += SIM_TICK;
+        if(sim.hold_requested) {
+            sim.hold_requested = false;
+            sim.hold = SIM_HOLD;
+            sim_operator();
+        } else if(sim.hold)
+            sim.hold--;
+    }
+
+    grbl.on_execute_realtime(state_get());
+
+    return true;
+}
+
+// A cycle start during a feed hold resumes the motion the operator stopped.
+void protocol_auto_cycle_start (void)
+{
+    if(sim.feed_hold)
+        sim_fail("feed hold ended by a cycle start");
+    else
+        sim.cycle = sim.count != 0;
+}
+
+bool protocol_enqueue_rt_command (on_execute_realtime_ptr fn)
+{
+    fn(state_get());
+
+    return true;
+}
+
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        position[idx] = (float)steps[idx] / settings.axis[idx].steps_per_mm;
+}
+
+void system_add_rt_report (report_tracking_t report)
+{
+    (void)report;
+}
+
+void system_set_exec_state_flag (uint_fast16_t flag)
+{
+    if(flag & EXEC_TOOL_CHANGE)
+        sim.hold_requested = true;
+}
+
+bool system_check_travel_limits (float *target)
+{
+    (void)target;
+
+    return true;
+}
+
+sys_state_t state_get (void)
+{
+    return sim.feed_hold ? STATE_HOLD : (sim.hold ? STATE_TOOL_CHANGE : (sim.cycle ? STATE_CYCLE : STATE_IDLE));
+}
+
+bool gc_set_tool_offset (tool_offset_mode_t mode, uint_fast8_t idx, int32_t offset)
+{
+    (void)mode;
+    (void)idx;
+    (void)offset;
+
+    return true;
+}
+
+void report_message (const char *msg, message_type_t type)
+{
+    (void)type;
+
+    if(sim.verbose)
+        printf("%8u %s\n", (unsigned)sim.now, msg);
+
+    if(type == Message_Warning)
+        snprintf(sim.warning, sizeof(sim.warning), "%s", msg);
+
+    if(!strncmp(msg, "Manual tool change:", 19))
+        snprintf(sim.prompt, sizeof(sim.prompt), "%s", msg);
+}
+
+bool ioport_can_claim_explicit (void)
+{
+    return true;
+}
+
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description)
+{
+    (void)type;
+    (void)dir;
+    (void)port;
+    (void)description;
+
+    return true;
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[4][12];
+    static uint_fast8_t idx;
+
+    idx = (idx + 1) % 4;
+    snprintf(buf[idx], sizeof(buf[idx]), "%u", (unsigned)n);
+
+    return buf[idx];
+}
+
+bool read_float (char *line, uint_fast8_t *char_counter, float *float_ptr)
+{
+    char *end;
+
+    *float_ptr = strtof(line + *char_counter, &end);
+    if(end == line + *char_counter)
+        return false;
+
+    *char_counter = (uint_fast8_t)(end - line);
+
+    return true;
+}
+
+char *ftoa (float n, uint8_t decimal_places)
+{
+    static char buf[4][32];
+    static uint_fast8_t idx;
+
+    idx = (idx + 1) % 4;
+    snprintf(buf[idx], sizeof(buf[idx]), "%.*f", decimal_places, (double)n);
+
+    return buf[idx];
+}
+
+struct vfs_file {
+    FILE *file;
+};
+
+vfs_file_t *vfs_open (const char *filename, const char *mode)
+{
+    vfs_file_t *file;
+
+    if((file = malloc(sizeof(vfs_file_t))) && (file->file = fopen(filename, mode)) == NULL) {
+        free(file);
+        file = NULL;
+    }
+
+    return file;
+}
+
+void vfs_close (vfs_file_t *file)
+{
+    fclose(file->file);
+    free(file);
+}
+
+size_t vfs_read (void *buffer, size_t size, size_t count, vfs_file_t *file)
+{
+    return fread(buffer, size, count, file->file);
+}
+
+/* Test helpers */
+
+// Magazine of 8 pockets along X with a tool setter and the recognition sensor, on a machine homed at the origin.
+static void sim_settings (void)
+{
+    my_settings.alignment = 0;
+    my_settings.direction = 0;
+    my_settings.number_of_pockets = 8;
+    my_settings.pocket_offset = 45;
+    my_settings.pocket_1_x_pos = 100.0f;
+    my_settings.pocket_1_y_pos = 10.0f;
+    my_settings.tool_engagement_feed_rate = 1500;
+    my_settings.tool_pickup_rpm = 1200;
+    my_settings.tool_dropoff_rpm = 1200;
+    my_settings.tool_z_engagement = 10;
+    my_settings.tool_z_traverse = 40;
+    my_settings.tool_z_safe_clearance = 80;
+    my_settings.tool_start_height = 30.0f;
+    my_settings.tool_setter = true;
+    my_settings.tool_recognition = true;
+    my_settings.dust_cover = false;
+    my_settings.swap_mode = false;
+    my_settings.dropoff_policy = DropOff_ToolPocket;
+    my_settings.toolsetter_seek_rate = 800;
+    my_settings.toolsetter_retreat = 2;
+    my_settings.toolsetter_feed_rate = 100;
+    my_settings.toolsetter_max_travel = 50;
+    my_settings.toolsetter_x_pos = 60.0f;
+    my_settings.toolsetter_y_pos = 300.0f;
+    my_settings.toolsetter_z_start_pos = 60.0f;
+    my_settings.toolsetter_margin = 0.0f;
+    my_settings.tlo_cache = false;
+    my_settings.toolsetter_safe_z = 80.0f;
+    my_settings.spinup_delay = 500;
+    my_settings.spindown_delay = 500;
+    my_settings.toolrecognition_detect_zone_1 = 20.0f;
+    my_settings.toolrecognition_detect_zone_2 = 25.0f;
+    my_settings.rows = 1;
+    my_settings.row_offset = 0.0f;
+    memset(my_settings.rack, 0, sizeof(my_settings.rack));
+    my_settings.keepout_margin = 0.0f;
+    memset(my_settings.keepout, 0, sizeof(my_settings.keepout));
+}
+
+static void sim_init (void)
+{
+    uint_fast8_t idx;
+
+    memset(&sim, 0, sizeof(sim_t));
+    sim.nvs_next = 16;
+    memset(sim.nvs, 0xFF, sizeof(sim.nvs));
+
+    hal.driver_reset = sim_driver_reset;
+    hal.get_elapsed_ticks = sim_get_elapsed_ticks;
+    hal.get_micros = sim_get_micros;
+    hal.stream.write = sim_stream_write;
+    hal.coolant.set_state = sim_coolant_set_state;
+    hal.nvs.memcpy_to_nvs = sim_memcpy_to_nvs;
+    hal.nvs.memcpy_from_nvs = sim_memcpy_from_nvs;
+    hal.nvs.get_byte = sim_nvs_get_byte;
+    hal.nvs.put_byte = sim_nvs_put_byte;
+    hal.port.digital_out = sim_digital_out;
+    hal.port.wait_on_input = sim_wait_on_input;
+    grbl.on_execute_realtime = sim_on_execute_realtime;
+    grbl.on_report_options = sim_on_report_options;
+    grbl.on_realtime_report = sim_on_realtime_report;
+    grbl.on_get_commands = sim_on_get_commands;
+
+    gc_state.tool = &sim_tool;
+    sys.homed.mask = X_AXIS_BIT|Y_AXIS_BIT|Z_AXIS_BIT;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        settings.axis[idx].steps_per_mm = 100.0f;
+        settings.axis[idx].max_rate = 5000.0f;
+        settings.axis[idx].acceleration = 500.0f * 3600.0f;
+        settings.axis[idx].max_travel = -1500.0f;
+    }
+
+    // Settings are loaded once the plugins are initialized, as settings_init() does.
+    my_plugin_init();
+    sim_settings_details->load();
+
+    // Load the simulated settings again as at the next boot, for the ports they enable to be claimed.
+    sim_settings();
+    sim_settings_details->save();
+    sim_settings_details->load();
+}
+
+// Set the position of the machine, with the planner empty.
+static void sim_move_to (float x, float y, float z)
+{
+    sim_settle();
+
+    memset(&sim.position, 0, sizeof(coord_data_t));
+    sim.position.x = x;
+    sim.position.y = y;
+    sim.position.z = z;
+    memcpy(&sim.planned, &sim.position, sizeof(coord_data_t));
+    sim_update_position();
+}
+
+// Compile the magazine, assign tool N to pocket N and put it there. The lowest engagement height is the floor for Z.
+static bool sim_magazine (void)
+{
+    uint16_t pocket;
+
+    geometry_compile();
+
+    if(geometry.status != Status_OK)
+        return false;
+
+    memset(sim.pocket_tool, 0, sizeof(sim.pocket_tool));
+
+    for(pocket = 0; pocket < ATC_MAX_POCKETS; pocket++) {
+        pocket_map.tool_id[pocket] = pocket < geometry.n_pockets ? pocket + 1 : 0;
+        sim.pocket_tool[pocket + 1] = pocket_map.tool_id[pocket];
+    }
+
+    pocket_map_index();
+
+    sim.z_floor = my_settings.tool_z_engagement;
+    for(pocket = 0; pocket < geometry.n_pockets; pocket++)
+        sim.z_floor = min(sim.z_floor, my_settings.tool_z_engagement + pocket_z_offset(pocket));
+
+    return true;
+}
+
+// Put the last keep-out box between a pocket and the next one in the same row, reaching above
+// the traverse height. Pockets at the end of a row or rack get no divider.
+static bool sim_divider (uint16_t pocket)
+{
+    atc_keepout_settings_t *box = &my_settings.keepout[ATC_MAX_KEEPOUTS - 1];
+    float x, y, dx, dy;
+
+    if(pocket + 1 >= geometry.n_pockets || geometry.rack_of[pocket] != geometry.rack_of[pocket + 1])
+        return true;
+
+    dx = fabsf(geometry.x[pocket + 1] - geometry.x[pocket]);
+    dy = fabsf(geometry.y[pocket + 1] - geometry.y[pocket]);
+
+    // The last pocket of a row and the first of the next.
+    if(dx > SIM_EPSILON && dy > SIM_EPSILON)
+        return true;
+
+    x = (geometry.x[pocket] + geometry.x[pocket + 1]) / 2.0f;
+    y = (geometry.y[pocket] + geometry.y[pocket + 1]) / 2.0f;
+    dx = dx > SIM_EPSILON ? 5.0f : 20.0f;
+    dy = dy > SIM_EPSILON ? 5.0f : 20.0f;
+
+    box->x_min = x - dx;
+    box->x_max = x + dx;
+    box->y_min = y - dy;
+    box->y_max = y + dy;
+    box->z_top = my_settings.tool_z_traverse + 5.0f;
+
+    return sim_magazine();
+}
+
+// M61, the tool in the spindle is set without moving.
+static void sim_m61 (uint32_t tool_id)
+{
+    sim_tool.tool_id = tool_id;
+    tool_select(&sim_tool, false);
+    gc_state.tool_pending = tool_id;
+}
+
+// M6, with a reset injected at the given realtime loop iteration if not 0.
+// The parser completes the planned motion before the tool change as gcode.c does.
+static status_code_t sim_m6 (uint32_t reset_at)
+{
+    uint32_t feed_hold_at = sim.feed_hold_at;
+
+    sim.feed_hold_at = 0;
+    sim.calls = 0;
+    sim.reset_at = 0;
+    sim.reset = false;
+    protocol_buffer_synchronize();
+
+    sim.calls = 0;
+    sim.reset_at = reset_at;
+    sim.feed_hold_at = feed_hold_at;
+    sim.moves = sim.syncs = sim.spindle_changes = sim.collisions = sim.probes = 0;
+
+    return hal.tool.change(&gc_state);
+}
@@ -0,0 +1,387 @@
+/*
+  stress.c - randomized tool change sequences on the simulated machine
+
+  Runs sequences of tool selections, M61, M6 and resets across random magazine settings and checks
+  that the tool the plugin reports matches the simulated machine, that Z only descends below the
+  engagement height over a pocket or the tool setter, that no move crosses a keep-out box and that
+  tool changes stay within bounds on moves and planner stalls. A reset may hit any phase, a change
+  interrupted with the spindle not holding the tool the plugin reports is completed by $ATCRESUME.
+
+  Usage: atc_stress [sequences [first seed [workers]]]
+  The sequences are split across one worker process per core by default, runs are repeatable and
+  a failing sequence is rerun on its own with atc_stress 1 <seed>, which prints the moves.
+*/
+
+#include <unistd.h>
+#include <time.h>
+#include <sys/wait.h>
+
+#include "sim.h"
+
+#define STRESS_SEQUENCES    20000       // default number of sequences
+#define STRESS_STEPS        8           // tool selections and changes per sequence
+#define STRESS_MAX_MOVES    96          // bound on the moves of a single tool change
+#define STRESS_MAX_SYNCS    16          // bound on the planner stalls of a single tool change
+#define STRESS_RESET_SPAN   400         // realtime loop iterations a reset is injected within
+#define STRESS_REPORTS      8           // failures reported in detail by each worker
+
+typedef struct {
+    uint32_t sequences;
+    uint32_t changes;
+    uint32_t resets;
+    uint32_t resumes;
+    uint32_t skipped;                   // sequences with settings that do not compile
+    uint32_t failures;
+    uint32_t phase_resets[ATC_NumPhases];
+} stress_counts_t;
+
+static stress_counts_t counts;
+static uint32_t rng, seed;
+static tool_data_t next;                // tool selected by the simulated program
+
+static uint32_t stress_random (uint32_t range)
+{
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+
+    return rng % range;
+}
+
+// Tool 0, a tool without a pocket or a tool in the magazine.
+static uint32_t stress_tool (void)
+{
+    switch(stress_random(8)) {
+
+        case 0:
+            return 0;
+
+        case 1:
+            return geometry.n_pockets + 1 + stress_random(16);
+
+        default:
+            return 1 + stress_random(geometry.n_pockets);
+    }
+}
+
+// Settings of a sequence, magazine layouts with and without a second rack and keep-out box.
+// A divider between two pockets may be added once the magazine is compiled.
+static void stress_settings (void)
+{
+    sim_settings();
+
+    my_settings.number_of_pockets = 1 + stress_random(24);
+    my_settings.alignment = stress_random(2);
+    my_settings.direction = stress_random(2);
+    my_settings.rows = 1 + stress_random(3);
+    my_settings.row_offset = my_settings.rows > 1 ? (stress_random(2) ? 60.0f : -60.0f) : 0.0f;
+    my_settings.swap_mode = stress_random(2);
+    my_settings.dropoff_policy = stress_random(2);
+    my_settings.tool_recognition = stress_random(2);
+    my_settings.tool_setter = stress_random(2);
+    my_settings.tlo_cache = stress_random(2);
+    my_settings.lookahead = stress_random(2);
+    my_settings.thread_pitch = stress_random(2) ? 1.5f : 0.0f;
+    my_settings.manual_x_pos = (float)stress_random(300);
+    my_settings.manual_y_pos = (float)stress_random(300);
+
+    if(stress_random(4) == 0) {
+        my_settings.rack[0].pockets = 1 + stress_random(8);
+        my_settings.rack[0].rows = 1;
+        my_settings.rack[0].alignment = stress_random(2);
+        my_settings.rack[0].pocket_offset = my_settings.pocket_offset;
+        my_settings.rack[0].pocket_1_x_pos = my_settings.pocket_1_x_pos;
+        my_settings.rack[0].pocket_1_y_pos = my_settings.pocket_1_y_pos + 200.0f;
+        my_settings.rack[0].z_offset = (float)stress_random(21) - 10.0f;
+    }
+
+    if(stress_random(4) == 0) {
+        my_settings.keepout_margin = (float)stress_random(3);
+        my_settings.keepout[0].x_min = my_settings.pocket_1_x_pos - 90.0f;
+        my_settings.keepout[0].x_max = my_settings.pocket_1_x_pos - 60.0f;
+        my_settings.keepout[0].y_min = my_settings.pocket_1_y_pos - 40.0f;
+        my_settings.keepout[0].y_max = my_settings.pocket_1_y_pos + 40.0f;
+        my_settings.keepout[0].z_top = my_settings.tool_z_traverse - 5.0f;
+    }
+}
+
+// M61, the operator puts the tool in the spindle back in its pocket and takes the new tool from its pocket.
+static void stress_m61 (uint32_t tool_id)
+{
+    uint16_t pocket;
+
+    if(sim.spindle_tool && (pocket = pocket_for_tool(sim.spindle_tool)) != ATC_NO_POCKET && sim.pocket_tool[pocket + 1] == 0)
+        sim.pocket_tool[pocket + 1] = sim.spindle_tool;
+
+    for(pocket = 1; pocket <= geometry.n_pockets; pocket++) {
+        if(tool_id && sim.pocket_tool[pocket] == tool_id)
+            sim.pocket_tool[pocket] = 0;
+    }
+
+    sim.spindle_tool = tool_id;
+    sim_m61(tool_id);
+
+    if(sim.verbose)
+        printf("M61 Q%u\n", (unsigned)tool_id);
+}
+
+static void stress_select (uint32_t tool_id)
+{
+    next.tool_id = tool_id;
+    tool_select(&next, true);
+
+    if(sim.verbose)
+        printf("T%u\n", (unsigned)tool_id);
+}
+
+// Resume the tool change interrupted by a reset, or discard it when the spindle holds the tool the
+// plugin reports. The spindle must hold that tool when there is nothing to resume.
+static void stress_recover (uint32_t tool_id)
+{
+    char discard[] = "0";
+    status_code_t status;
+
+    if(checkpoint.phase == ATC_Idle) {
+        if(current_tool.tool_id != sim.spindle_tool)
+            sim_fail("tool in the spindle lost on reset");
+        return;
+    }
+
+    if(current_tool.tool_id == sim.spindle_tool && stress_random(2)) {
+        resume_cmd(STATE_IDLE, discard);
+        return;
+    }
+
+    counts.resumes++;
+    sim.calls = 0;
+
+    if(sim.verbose)
+        printf("Reset in %s, resuming from %s with T%u in the spindle\n", phase_name[sim.reset_phase], phase_name[checkpoint.phase], (unsigned)sim.spindle_tool);
+
+    status = resume_cmd(STATE_IDLE, NULL);
+    sim_idle();
+
+    if(status != Status_OK)
+        sim_fail("resumed tool change failed");
+    else if(checkpoint.phase != ATC_Idle)
+        sim_fail("checkpoint kept after resume");
+    else if(current_tool.tool_id != tool_id)
+        sim_fail("tool not loaded on resume");
+    else if(gc_state.tool->tool_id != tool_id)
+        sim_fail("parser state not updated on resume");
+}
+
+// M6, optionally reset part way, and check the state of the plugin against the simulated machine.
+static void stress_m6 (void)
+{
+    bool selected = next_tool != NULL;
+    uint32_t tool_id = selected ? next_tool->tool_id : 0;
+    status_code_t status;
+
+    sim.blocked_reads = stress_random(8) == 0;
+
+    if(sim.verbose)
+        printf("M6 T%u, T%u in the spindle\n", (unsigned)tool_id, (unsigned)sim.spindle_tool);
+
+    status = sim_m6(stress_random(3) == 0 ? 1 + stress_random(STRESS_RESET_SPAN) : 0);
+    counts.changes++;
+
+    if(sim.moves > STRESS_MAX_MOVES)
+        sim_fail("too many moves");
+
+    if(sim.syncs > STRESS_MAX_SYNCS)
+        sim_fail("too many planner stalls");
+
+    if(!selected && status != Status_GCodeToolError)
+        sim_fail("M6 without a tool selected not rejected");
+    else if(sequence.phase != ATC_Idle)
+        sim_fail("tool change not completed");
+    else if(sim.reset) {
+        counts.resets++;
+        counts.phase_resets[sim.reset_phase]++;
+        if(next_tool != NULL)
+            sim_fail("next tool kept after reset");
+        stress_recover(tool_id);
+    } else if(selected && status != Status_OK)
+        sim_fail("tool change failed");
+    else if(selected && current_tool.tool_id != tool_id)
+        sim_fail("tool not loaded");
+    else if(selected)
+        sim_tool.tool_id = tool_id;
+
+    if(current_tool.tool_id != sim.spindle_tool)
+        sim_fail("current tool does not match the spindle");
+}
+
+// Run a sequence of tool selections and changes on a random magazine from a random position.
+static void stress_sequence (void)
+{
+    char discard[] = "0";
+    uint_fast8_t step;
+    uint16_t pocket;
+
+    rng = (seed + 1) * 2654435761UL;
+    sim.failure = NULL;
+    counts.sequences++;
+
+    stress_settings();
+
+    if(!sim_magazine() || (stress_random(4) == 0 && !sim_divider(stress_random(geometry.n_pockets)))) {
+        counts.skipped++;
+        return;
+    }
+
+    // Leave some pockets empty.
+    for(pocket = 0; pocket < geometry.n_pockets; pocket++) {
+        if(stress_random(4) == 0)
+            pocket_map.tool_id[pocket] = 0;
+    }
+    pocket_map_index();
+    memcpy(&sim.pocket_tool[1], pocket_map.tool_id, sizeof(pocket_map.tool_id));
+
+    // Sequences are independent so a failing one can be rerun on its own, the machine has been idle for a while.
+    resume_cmd(STATE_IDLE, discard);
+    tlo_cmd(STATE_IDLE, discard);
+    memset(&current_tool, 0, sizeof(tool_data_t));
+    sim.spindle_tool = 0;
+    stress_m61(stress_tool());
+    next_tool = NULL;
+
+    sim.now += 60000;
+    sim_move_to((float)stress_random(400), (float)stress_random(400),
+                 sim.z_floor - 20.0f + (float)stress_random((uint32_t)(my_settings.tool_z_safe_clearance - sim.z_floor) + 20));
+
+    for(step = 0; step < STRESS_STEPS && sim.failure == NULL; step++) {
+
+        switch(stress_random(8)) {
+
+            case 0:
+                stress_m61(stress_tool());
+                break;
+
+            case 1:
+                stress_select(stress_tool());
+                break;
+
+            case 2:
+                stress_m6();
+                break;
+
+            default:
+                stress_select(stress_random(4) ? stress_tool() : current_tool.tool_id);
+                stress_m6();
+                break;
+        }
+    }
+
+    if(sim.failure && ++counts.failures <= STRESS_REPORTS) {
+        printf("FAIL seed %u: %s: %s\n", (unsigned)seed, phase_name[sim.failure_phase], sim.failure);
+        fflush(stdout);
+    }
+}
+
+static void stress_worker (uint32_t first, uint32_t sequences, uint32_t step, uint32_t offset)
+{
+    uint32_t idx;
+
+    sim_init();
+    sim.verbose = sequences == 1;
+
+    for(idx = offset; idx < sequences; idx += step) {
+        seed = first + idx;
+        stress_sequence();
+    }
+}
+
+static double elapsed_ms (struct timespec *start)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (double)(now.tv_sec - start->tv_sec) * 1000.0 + (double)(now.tv_nsec - start->tv_nsec) / 1.0e6;
+}
+
+int main (int argc, char **argv)
+{
+    uint32_t sequences = argc > 1 ? (uint32_t)strtoul(argv[1], NULL, 10) : STRESS_SEQUENCES;
+    uint32_t first = argc > 2 ? (uint32_t)strtoul(argv[2], NULL, 10) : 1;
+    long idx, phase, workers = argc > 3 ? strtol(argv[3], NULL, 10) : sysconf(_SC_NPROCESSORS_ONLN);
+    stress_counts_t totals = {0};
+    struct timespec start;
+    double ms;
+    int status;
+
+    if(workers < 1)
+        workers = 1;
+    if(workers > (long)sequences)
+        workers = sequences ? (long)sequences : 1;
+
+    int fd[workers];
+    pid_t pid[workers];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fflush(stdout);
+
+    for(idx = 0; idx < workers; idx++) {
+
+        int pipefd[2];
+
+        if(pipe(pipefd) || (pid[idx] = fork()) < 0) {
+            perror("atc_stress");
+            return 2;
+        }
+
+        if(pid[idx] == 0) {
+            close(pipefd[0]);
+            stress_worker(first, sequences, (uint32_t)workers, (uint32_t)idx);
+            fflush(stdout);
+            if(write(pipefd[1], &counts, sizeof(stress_counts_t)) != sizeof(stress_counts_t))
+                _exit(2);
+            _exit(0);
+        }
+
+        close(pipefd[1]);
+        fd[idx] = pipefd[0];
+    }
+
+    for(idx = 0; idx < workers; idx++) {
+
+        stress_counts_t worker = {0};
+
+        if(read(fd[idx], &worker, sizeof(stress_counts_t)) != sizeof(stress_counts_t)) {
+            printf("FAIL worker %ld did not complete\n", idx);
+            worker.failures = 1;
+        }
+        close(fd[idx]);
+
+        if(waitpid(pid[idx], &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            printf("FAIL worker %ld exited abnormally\n", idx);
+            worker.failures++;
+        }
+
+        totals.sequences += worker.sequences;
+        totals.changes += worker.changes;
+        totals.resets += worker.resets;
+        totals.resumes += worker.resumes;
+        totals.skipped += worker.skipped;
+        totals.failures += worker.failures;
+        for(phase = 0; phase < ATC_NumPhases; phase++)
+            totals.phase_resets[phase] += worker.phase_resets[phase];
+    }
+
+    ms = elapsed_ms(&start);
+
+    printf("%u sequences, %u tool changes, %u resets, %u resumed, %u skipped, %u failures\n",
+            (unsigned)totals.sequences, (unsigned)totals.changes, (unsigned)totals.resets,
+             (unsigned)totals.resumes, (unsigned)totals.skipped, (unsigned)totals.failures);
+
+    printf("resets by phase:");
+    for(phase = 0; phase < ATC_NumPhases; phase++)
+        printf(" %s %u", phase_name[phase], (unsigned)totals.phase_resets[phase]);
+    printf("\n");
+
+    printf("%ld workers, %.0f ms, %.0f tool changes/s\n", workers, ms, ms > 0.0 ? (double)totals.changes * 1000.0 / ms : 0.0);
+
+    return totals.failures ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+/*
+  grbl/nuts_bolts.h - host test stub of the grblHAL core
+
+  Helpers, implemented by the simulator.
+*/
+
+#ifndef _STUB_GRBL_NUTS_BOLTS_H_
+#define _STUB_GRBL_NUTS_BOLTS_H_
+
+#include "hal.h"
+
+#define SOME_LARGE_VALUE 1.0E+38f
+
+#define min(a,b) (((a) < (b)) ? (a) : (b))
+#define max(a,b) (((a) > (b)) ? (a) : (b))
+char *ftoa(float n, uint8_t decimal_places);
+char *uitoa(uint32_t n);
+bool read_float(char *line, uint_fast8_t *char_counter, float *float_ptr);
+
+#endif
@@ -0,0 +1,14 @@
+/*
+  grbl/nvs_buffer.h - host test stub of the grblHAL core
+
+  NVS allocation, implemented by the simulator.
+*/
+
+#ifndef _STUB_GRBL_NVS_BUFFER_H_
+#define _STUB_GRBL_NVS_BUFFER_H_
+
+#include "hal.h"
+
+nvs_address_t nvs_alloc(size_t size);
+
+#endif
@@ -0,0 +1,17 @@
+/*
+  grbl/vfs.h - host test stub of the grblHAL core
+
+  File access, implemented by the simulator on top of stdio.
+*/
+
+#ifndef _STUB_GRBL_VFS_H_
+#define _STUB_GRBL_VFS_H_
+
+#include "hal.h"
+
+typedef struct vfs_file vfs_file_t;
+vfs_file_t *vfs_open(const char *filename, const char *mode);
+void vfs_close(vfs_file_t *file);
+size_t vfs_read(void *buffer, size_t size, size_t count, vfs_file_t *file);
+
+#endif
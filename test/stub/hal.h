@@ -0,0 +1,185 @@
+/*
+  hal.h - host test stub of the grblHAL core
+
+  Declares only the parts of the core API used by the plugin, with the
+  layout simplified where the plugin does not depend on it.
+*/
+
+#ifndef _STUB_HAL_H_
+#define _STUB_HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define N_AXIS 4
+#define X_AXIS 0
+#define Y_AXIS 1
+#define Z_AXIS 2
+#define A_AXIS 3
+#define X_AXIS_BIT 1
+#define Y_AXIS_BIT 2
+#define Z_AXIS_BIT 4
+
+#define On 1
+#define Off 0
+#define ASCII_EOL "\r\n"
+
+#ifndef SDCARD_ENABLE
+#define SDCARD_ENABLE 1
+#endif
+
+typedef uint_fast16_t sys_state_t;
+
+#define STATE_IDLE 0
+#define STATE_ALARM 1
+#define STATE_CHECK_MODE 2
+#define STATE_CYCLE 8
+#define STATE_HOLD 16
+#define STATE_TOOL_CHANGE 32
+#define STATE_ESTOP 64
+#define STATE_JOG 128
+#define STATE_SAFETY_DOOR 256
+#define STATE_SLEEP 512
+
+#define EXEC_TOOL_CHANGE 1
+
+typedef uint32_t nvs_address_t;
+#define NVS_CRC_BYTES 1
+typedef enum { NVS_TransferResult_Failed = 0, NVS_TransferResult_Busy, NVS_TransferResult_OK } nvs_transfer_result_t;
+
+typedef enum {
+    Status_OK = 0,
+    Status_GcodeInvalidTarget,
+    Status_GCodeToolError,
+    Status_HomingRequired,
+    Status_InvalidStatement,
+    Status_BadNumberFormat,
+    Status_SettingValueOutOfRange,
+    Status_IdleError,
+    Status_Unhandled,
+    Status_GcodeUnsupportedCommand,
+    Status_SDFailedOpenFile,
+    Status_TravelExceeded,
+    Status_FileReadError,
+    Status_Reset
+} status_code_t;
+
+typedef union { float values[N_AXIS]; struct { float x, y, z, a; }; } coord_data_t;
+typedef union { uint8_t value; struct { uint8_t on:1, ccw:1, pwm:1, reserved:1, at_speed:1, encoder_error:1; }; } spindle_state_t;
+typedef union { uint8_t value; struct { uint8_t flood:1, mist:1; }; } coolant_state_t;
+typedef union { uint8_t mask; struct { uint8_t x:1,y:1,z:1,a:1; }; } axes_signals_t;
+typedef union { uint16_t value; struct { uint16_t variable:1, direction:1, at_speed:1, laser:1, spindle_encoder:1; }; } spindle_cap_t;
+typedef struct spindle_ptrs spindle_ptrs_t;
+struct spindle_ptrs {
+    spindle_cap_t cap;
+    void (*set_state)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm);
+    spindle_state_t (*get_state)(spindle_ptrs_t *spindle);
+};
+typedef struct { float rpm; spindle_state_t state; spindle_ptrs_t *hal; } spindle_t;
+typedef union { uint16_t value; struct { uint16_t rapid_motion:1, system_motion:1, jog_motion:1, no_feed_override:1, inverse_time:1, is_laser_ppi_mode:1, target_validated:1, target_valid:1; }; } planner_cond_t;
+typedef struct { float feed_rate; float path_tolerance; spindle_t spindle; coolant_state_t coolant; planner_cond_t condition; int32_t line_number; } plan_line_data_t;
+typedef struct { uint32_t tool_id; float offset[N_AXIS]; float radius; } tool_data_t;
+typedef enum { ToolLengthOffset_Cancel = 0, ToolLengthOffset_Enable, ToolLengthOffset_EnableDynamic, ToolLengthOffset_ApplyAdditional } tool_offset_mode_t;
+typedef struct plan_block { struct plan_block *prev, *next; int32_t line_number; } plan_block_t;
+typedef union { uint16_t value; struct { uint16_t probe_is_away:1, probe_is_no_error:1; }; } gc_parser_flags_t;
+typedef enum { GCProbe_Found = 0, GCProbe_Abort, GCProbe_FailInit, GCProbe_FailEnd, GCProbe_CheckMode } gc_probe_t;
+typedef struct { tool_data_t *tool; uint32_t tool_pending; bool tool_change; } parser_state_t;
+extern parser_state_t gc_state;
+
+typedef struct {
+    bool abort;
+    bool suspend;
+    int32_t position[N_AXIS];
+    int32_t probe_position[N_AXIS];
+    int32_t tlo_reference[N_AXIS];
+    axes_signals_t tlo_reference_set;
+    axes_signals_t homed;
+} system_t;
+extern system_t sys;
+typedef struct { float steps_per_mm; float max_rate; float acceleration; float max_travel; } axis_settings_t;
+typedef struct { axis_settings_t axis[N_AXIS]; struct { union { uint8_t value; struct { uint8_t hard_enabled:1, soft_enabled:1; }; } flags; } limits; } settings_t;
+extern settings_t settings;
+
+typedef enum { Report_Tool = 1, Report_TLOReference = 2 } report_tracking_t;
+typedef union { uint32_t value; } report_tracking_flags_t;
+typedef enum { Message_Plain = 0, Message_Info, Message_Warning } message_type_t;
+typedef void (*stream_write_ptr)(const char *s);
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_realtime_report_ptr)(stream_write_ptr stream_write, report_tracking_flags_t report);
+typedef enum { ProgramFlow_Running = 0, ProgramFlow_Paused, ProgramFlow_CompletedM2, ProgramFlow_CompletedM30 } program_flow_t;
+typedef void (*on_program_completed_ptr)(program_flow_t program_flow, bool check_mode);
+typedef void (*driver_reset_ptr)(void);
+
+typedef status_code_t (*sys_command_ptr)(sys_state_t state, char *args);
+typedef union { uint8_t flags; struct { uint8_t noargs:1, allow_blocking:1, help_fully_defined:1; }; } sys_command_flags_t;
+typedef union { const char *str; const char *(*fn)(const char *command); } sys_command_help_t;
+typedef struct { const char *command; sys_command_ptr execute; sys_command_flags_t flags; sys_command_help_t help; } sys_command_t;
+typedef struct sys_commands_str { const uint8_t n_commands; const sys_command_t *commands; struct sys_commands_str *(*on_get_commands)(void); } sys_commands_t;
+typedef sys_commands_t *(*on_get_commands_ptr)(void);
+
+typedef enum { Port_Analog = 0, Port_Digital } io_port_type_t;
+typedef enum { Port_Input = 0, Port_Output } io_port_direction_t;
+typedef enum { IRQ_Mode_None = 0, IRQ_Mode_Rising = 1, IRQ_Mode_Falling = 2, IRQ_Mode_Change = 3 } pin_irq_mode_t;
+typedef enum { WaitMode_Immediate = 0, WaitMode_Rise, WaitMode_Fall } wait_mode_t;
+typedef void (*ioport_interrupt_callback_ptr)(uint8_t port, bool state);
+
+typedef struct {
+    driver_reset_ptr driver_reset;
+    uint32_t (*get_elapsed_ticks)(void);
+    uint32_t (*get_micros)(void);
+    struct { void (*write)(const char *s); } stream;
+    struct { void (*set_state)(coolant_state_t mode); } coolant;
+    struct {
+        nvs_transfer_result_t (*memcpy_to_nvs)(nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum);
+        nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum);
+        uint8_t (*get_byte)(uint32_t addr);
+        void (*put_byte)(uint32_t addr, uint8_t new_value);
+    } nvs;
+    struct { void (*select)(tool_data_t *tool, bool next); status_code_t (*change)(parser_state_t *parser_state); } tool;
+    struct {
+        void (*digital_out)(uint8_t port, bool on);
+        int32_t (*wait_on_input)(io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout);
+        bool (*register_interrupt_handler)(uint8_t port, pin_irq_mode_t irq_mode, ioport_interrupt_callback_ptr interrupt_callback);
+    } port;
+    struct { uint32_t atc:1; } driver_cap;
+} grbl_hal_t;
+extern grbl_hal_t hal;
+
+typedef struct {
+    on_report_options_ptr on_report_options;
+    on_realtime_report_ptr on_realtime_report;
+    on_program_completed_ptr on_program_completed;
+    on_execute_realtime_ptr on_execute_realtime;
+    on_get_commands_ptr on_get_commands;
+} grbl_t;
+extern grbl_t grbl;
+
+typedef enum { Group_Root = 0, Group_UserSettings } setting_group_t;
+typedef enum { Format_Bool = 0, Format_Bitfield, Format_XBitfield, Format_RadioButtons, Format_AxisMask, Format_Integer, Format_Decimal, Format_String, Format_Password, Format_IPv4, Format_Int8, Format_Int16 } setting_datatype_t;
+typedef enum { Setting_NonCore = 0, Setting_NonCoreFn, Setting_IsExtended, Setting_IsExtendedFn, Setting_IsLegacy, Setting_IsLegacyFn } setting_type_t;
+typedef uint16_t setting_id_t;
+#define Setting_UserDefined_2 902
+typedef struct { setting_group_t parent; setting_group_t id; const char *name; } setting_group_detail_t;
+typedef union { uint8_t value; struct { uint8_t reboot_required:1, allow_null:1; }; } setting_detail_flags_t;
+typedef struct setting_detail setting_detail_t;
+typedef bool (*setting_available_ptr)(const setting_detail_t *setting);
+struct setting_detail { setting_id_t id; setting_group_t group; const char *name; const char *unit; setting_datatype_t datatype; const char *format; const char *min_value; const char *max_value; setting_type_t type; void *value; void *get_value; setting_available_ptr is_available; setting_detail_flags_t flags; };
+typedef struct { setting_id_t id; const char *description; } setting_descr_t;
+typedef struct setting_details { const uint8_t n_groups; const setting_group_detail_t *groups; const uint16_t n_settings; const setting_detail_t *settings; const uint16_t n_descriptions; const setting_descr_t *descriptions; void (*save)(void); void (*load)(void); void (*restore)(void); } setting_details_t;
+
+void settings_register(setting_details_t *details);
+void system_convert_array_steps_to_mpos(float *position, int32_t *steps);
+void system_add_rt_report(report_tracking_t report);
+bool system_check_travel_limits(float *target);
+void system_set_exec_state_flag(uint_fast16_t flag);
+sys_state_t state_get(void);
+bool gc_set_tool_offset(tool_offset_mode_t mode, uint_fast8_t idx, int32_t offset);
+void report_message(const char *msg, message_type_t type);
+bool ioport_can_claim_explicit(void);
+bool ioport_claim(io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+
+#endif
@@ -0,0 +1,18 @@
+/*
+  motion_control.h - host test stub of the grblHAL core
+
+  Motion and planner entry points, implemented by the simulator.
+*/
+
+#ifndef _STUB_MOTION_CONTROL_H_
+#define _STUB_MOTION_CONTROL_H_
+
+#include "hal.h"
+
+bool mc_line(float *target, plan_line_data_t *pl_data);
+void plan_data_init(plan_line_data_t *plan_data);
+plan_block_t *plan_get_current_block(void);
+gc_probe_t mc_probe_cycle(float *target, plan_line_data_t *pl_data, gc_parser_flags_t parser_flags);
+bool plan_check_full_buffer(void);
+
+#endif
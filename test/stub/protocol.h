@@ -0,0 +1,17 @@
+/*
+  protocol.h - host test stub of the grblHAL core
+
+  Protocol loop entry points, implemented by the simulator.
+*/
+
+#ifndef _STUB_PROTOCOL_H_
+#define _STUB_PROTOCOL_H_
+
+#include "hal.h"
+
+bool protocol_buffer_synchronize(void);
+bool protocol_execute_realtime(void);
+void protocol_auto_cycle_start(void);
+bool protocol_enqueue_rt_command(on_execute_realtime_ptr fn);
+
+#endif